@@ -1,387 +1,583 @@
 #include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
-class Instruction
+// Assembler. Lines are split into string_view tokens over the source text,
+// mnemonics are looked up in a perfect hash table built at compile time, and
+// each instruction is encoded straight into its 32-bit word, so assembling
+// allocates nothing per line. Pass one resolves labels; pass two encodes
+// chunks of the source in parallel.
+
+// Operand layout of a mnemonic, which also selects its encoding
+enum class Syntax : uint8_t
 {
-public:
-    string opcode;
-    string func3;
-    string func7;
+    R,      // rd rs1 rs2
+    I,      // rd rs1 imm: ALU immediates, loads and JALR
+    S,      // rs2 rs1 imm
+    B,      // rs1 rs2 imm
+    J,      // rd imm
+    U,      // rd imm
+    None,   // NOP, ECALL
+    Counter // rd, as CSRRS rd, csr, x0
+};
 
-    Instruction(string opc, string f3 = "", string f7 = "") : opcode(opc), func3(f3), func7(f7) {}
+struct Mnemonic
+{
+    string_view name;
+    Syntax syntax;
+    uint8_t opcode, func3, func7;
+    uint16_t csr;
+};
 
-    virtual void toBinaryArray(bitset<32> &instruction) const = 0;
+// func7 of an I-type goes to imm[11:5], which tells SRAI from SRLI
+constexpr Mnemonic mnemonics[] = {
+    {"ADD", Syntax::R, 0b0110011, 0b000, 0b0000000, 0},
+    {"SUB", Syntax::R, 0b0110011, 0b000, 0b0100000, 0},
+    {"SLL", Syntax::R, 0b0110011, 0b001, 0b0000000, 0},
+    {"SLT", Syntax::R, 0b0110011, 0b010, 0b0000000, 0},
+    {"SLTU", Syntax::R, 0b0110011, 0b011, 0b0000000, 0},
+    {"XOR", Syntax::R, 0b0110011, 0b100, 0b0000000, 0},
+    {"SRL", Syntax::R, 0b0110011, 0b101, 0b0000000, 0},
+    {"SRA", Syntax::R, 0b0110011, 0b101, 0b0100000, 0},
+    {"OR", Syntax::R, 0b0110011, 0b110, 0b0000000, 0},
+    {"AND", Syntax::R, 0b0110011, 0b111, 0b0000000, 0},
+    {"MUL", Syntax::R, 0b0110011, 0b000, 0b0000001, 0},
+    {"MULH", Syntax::R, 0b0110011, 0b001, 0b0000001, 0},
+    {"MULHSU", Syntax::R, 0b0110011, 0b010, 0b0000001, 0},
+    {"MULHU", Syntax::R, 0b0110011, 0b011, 0b0000001, 0},
+    {"DIV", Syntax::R, 0b0110011, 0b100, 0b0000001, 0},
+    {"DIVU", Syntax::R, 0b0110011, 0b101, 0b0000001, 0},
+    {"REM", Syntax::R, 0b0110011, 0b110, 0b0000001, 0},
+    {"REMU", Syntax::R, 0b0110011, 0b111, 0b0000001, 0},
+    {"ADDI", Syntax::I, 0b0010011, 0b000, 0, 0},
+    {"SLTI", Syntax::I, 0b0010011, 0b010, 0, 0},
+    {"SLTIU", Syntax::I, 0b0010011, 0b011, 0, 0},
+    {"XORI", Syntax::I, 0b0010011, 0b100, 0, 0},
+    {"ORI", Syntax::I, 0b0010011, 0b110, 0, 0},
+    {"ANDI", Syntax::I, 0b0010011, 0b111, 0, 0},
+    {"SLLI", Syntax::I, 0b0010011, 0b001, 0, 0},
+    {"SRLI", Syntax::I, 0b0010011, 0b101, 0, 0},
+    {"SRAI", Syntax::I, 0b0010011, 0b101, 0b0100000, 0},
+    {"LB", Syntax::I, 0b0000011, 0b000, 0, 0},
+    {"LH", Syntax::I, 0b0000011, 0b001, 0, 0},
+    {"LW", Syntax::I, 0b0000011, 0b010, 0, 0},
+    {"LBU", Syntax::I, 0b0000011, 0b100, 0, 0},
+    {"LHU", Syntax::I, 0b0000011, 0b101, 0, 0},
+    {"JALR", Syntax::I, 0b1100111, 0b000, 0, 0},
+    {"SB", Syntax::S, 0b0100011, 0b000, 0, 0},
+    {"SH", Syntax::S, 0b0100011, 0b001, 0, 0},
+    {"SW", Syntax::S, 0b0100011, 0b010, 0, 0},
+    {"BEQ", Syntax::B, 0b1100011, 0b000, 0, 0},
+    {"BNE", Syntax::B, 0b1100011, 0b001, 0, 0},
+    {"BLT", Syntax::B, 0b1100011, 0b100, 0, 0},
+    {"BGE", Syntax::B, 0b1100011, 0b101, 0, 0},
+    {"BLTU", Syntax::B, 0b1100011, 0b110, 0, 0},
+    {"BGEU", Syntax::B, 0b1100011, 0b111, 0, 0},
+    {"JAL", Syntax::J, 0b1101111, 0, 0, 0},
+    {"LUI", Syntax::U, 0b0110111, 0, 0, 0},
+    {"AUIPC", Syntax::U, 0b0010111, 0, 0, 0},
+    {"NOP", Syntax::None, 0b0010011, 0, 0, 0},
+    {"ECALL", Syntax::None, 0b1110011, 0, 0, 0},
+    {"RDCYCLE", Syntax::Counter, 0b1110011, 0b010, 0, 0xC00},
+    {"RDTIME", Syntax::Counter, 0b1110011, 0b010, 0, 0xC01},
+    {"RDINSTRET", Syntax::Counter, 0b1110011, 0b010, 0, 0xC02},
+    {"RDCYCLEH", Syntax::Counter, 0b1110011, 0b010, 0, 0xC80},
+    {"RDTIMEH", Syntax::Counter, 0b1110011, 0b010, 0, 0xC81},
+    {"RDINSTRETH", Syntax::Counter, 0b1110011, 0b010, 0, 0xC82},
 };
 
-int regToNum(const string &reg)
+constexpr int MnemonicSlots = 256;
+
+// Seeded FNV-1a, reduced to a slot by its top bits
+constexpr uint32_t mnemonicSlot(string_view name, uint32_t seed)
 {
-    return stoi(reg.substr(1));
+    uint32_t hash = seed;
+    for (char c : name)
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    return hash >> 24;
 }
 
-int imm1ToNum(const string &imm1)
+// True when no two mnemonics share a slot under seed
+constexpr bool mnemonicSeedIsPerfect(uint32_t seed)
 {
-    int value = stoi(imm1, nullptr, 0);
-    // Sign-extend if negative
-    if (value < 0)
-        value |= 0xFFFFFFFF << 20; // Adjust bit length as needed
-    return value;
+    bool used[MnemonicSlots] = {};
+    for (const Mnemonic &m : mnemonics)
+    {
+        uint32_t slot = mnemonicSlot(m.name, seed);
+        if (used[slot])
+            return false;
+        used[slot] = true;
+    }
+    return true;
 }
 
-class Rtype : public Instruction
+// First seed, counting up from the FNV offset basis, under which the table is
+// collision-free. Searching for it at compile time overruns the compilers'
+// constexpr step limits, so it is fixed here; pick a new one offline when the
+// mnemonic list changes.
+constexpr uint32_t MnemonicSeed = 0x811CA804u;
+static_assert(mnemonicSeedIsPerfect(MnemonicSeed), "mnemonic hash seed collides; search for a new one");
+
+struct MnemonicTable
 {
-public:
-    string rd, rs1, rs2;
-    Rtype(string opc, string f3, string f7, string rd, string rs1, string rs2)
-        : Instruction(opc, f3, f7), rd(rd), rs1(rs1), rs2(rs2) {}
+    int8_t index[MnemonicSlots]; // into mnemonics, -1 for a free slot
+};
+
+constexpr MnemonicTable buildMnemonicTable()
+{
+    MnemonicTable table = {};
+    for (int8_t &index : table.index)
+        index = -1;
+    for (size_t i = 0; i < size(mnemonics); i++)
+        table.index[mnemonicSlot(mnemonics[i].name, MnemonicSeed)] = (int8_t)i;
+    return table;
+}
+
+constexpr MnemonicTable mnemonicTable = buildMnemonicTable();
 
-    void toBinaryArray(bitset<32> &instruction) const override
+const Mnemonic *findMnemonic(string_view name)
+{
+    int index = mnemonicTable.index[mnemonicSlot(name, MnemonicSeed)];
+    return index >= 0 && mnemonics[index].name == name ? &mnemonics[index] : nullptr;
+}
+
+// Parses a register: "x0".."x31" or its ABI name ("zero", "ra", "sp", "a0"...)
+int parseRegister(string_view token)
+{
+    static constexpr string_view abiNames[32] = {"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+                                                 "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+                                                 "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+                                                 "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"};
+    if (token.size() >= 2 && token.size() <= 3 && token[0] == 'x')
     {
-        instruction = bitset<32>(0x00000000);
-        instruction |= bitset<32>(stoi(opcode, nullptr, 2)) << 0;
-        instruction |= bitset<32>(regToNum(rd)) << 7;
-        instruction |= bitset<32>(stoi(func3, nullptr, 2)) << 12;
-        instruction |= bitset<32>(regToNum(rs1)) << 15;
-        instruction |= bitset<32>(regToNum(rs2)) << 20;
-        instruction |= bitset<32>(stoi(func7, nullptr, 2)) << 25;
+        int reg = 0;
+        for (char c : token.substr(1))
+            reg = c >= '0' && c <= '9' ? reg * 10 + (c - '0') : 99;
+        if (reg <= 31)
+            return reg;
     }
-};
+    if (token == "fp")
+        return 8;
+    for (int reg = 0; reg < 32; reg++)
+        if (abiNames[reg] == token)
+            return reg;
+    throw invalid_argument("bad register '" + string(token) + "'");
+}
 
-class Itype : public Instruction
+// Parses an integer like stoll(token, nullptr, 0): an optional sign, then
+// decimal, 0x hexadecimal or 0 octal. Returns false if token is not one or
+// does not fit in 64 bits.
+bool parseInteger(string_view token, int64_t &result)
 {
-public:
-    string rd, rs1, imm1;
-    Itype(string opc, string f3, string rd, string rs1, string imm1)
-        : Instruction(opc, f3), rd(rd), rs1(rs1), imm1(imm1) {}
+    string_view digits = token;
+    bool negative = !digits.empty() && digits[0] == '-';
+    if (!digits.empty() && (digits[0] == '-' || digits[0] == '+'))
+        digits.remove_prefix(1);
+    int base = 10;
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'))
+    {
+        base = 16;
+        digits.remove_prefix(2);
+    }
+    else if (digits.size() > 1 && digits[0] == '0')
+        base = 8;
 
-    void toBinaryArray(bitset<32> &instruction) const override
+    int64_t value = 0;
+    for (char c : digits)
     {
-        instruction = bitset<32>(0x00000000);
-        instruction |= bitset<32>(stoi(opcode, nullptr, 2)) << 0;
-        instruction |= bitset<32>(regToNum(rd)) << 7;
-        instruction |= bitset<32>(stoi(func3, nullptr, 2)) << 12;
-        instruction |= bitset<32>(regToNum(rs1)) << 15;
-        instruction |= bitset<32>(imm1ToNum(imm1)) << 20;
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 99;
+        if (digit >= base || value > (INT64_MAX - digit) / base)
+            return false;
+        value = value * base + digit;
     }
-};
+    if (digits.empty())
+        return false;
+    result = negative ? -value : value;
+    return true;
+}
 
-class Btype : public Instruction
+// As above, for a value that must fit in an int
+bool parseInteger(string_view token, int &result)
 {
-public:
-    string rs1, rs2, imm1;
-    Btype(string opc, string f3, string rs1, string rs2, string imm1) : Instruction(opc, f3), rs1(rs1), rs2(rs2), imm1(imm1) {}
+    int64_t value;
+    if (!parseInteger(token, value) || value < INT_MIN || value > INT_MAX)
+        return false;
+    result = (int)value;
+    return true;
+}
 
-    void toBinaryArray(bitset<32> &instruction) const override
-    {
-        instruction = bitset<32>(0x00000000);
-        int imm1Val = imm1ToNum(imm1);
-        int imm111 = (imm1Val >> 11) & 0x1;    // imm1ediate[11]
-        int imm14to1 = (imm1Val >> 1) & 0xF;   // imm1ediate[4:1]
-        int imm110to5 = (imm1Val >> 5) & 0x3F; // imm1ediate[10:5]
-        int imm112 = (imm1Val >> 12) & 0x1;    // imm1ediate[12] (sign bit)
+int parseImmediate(string_view token)
+{
+    int value;
+    if (!parseInteger(token, value))
+        throw invalid_argument("bad immediate '" + string(token) + "'");
+    return value;
+}
 
-        instruction |= bitset<32>(stoi(opcode, nullptr, 2)) << 0;
-        instruction |= bitset<32>(imm14to1) << 8;
-        instruction |= bitset<32>(imm111) << 7;
-        instruction |= bitset<32>(stoi(func3, nullptr, 2)) << 12;
-        instruction |= bitset<32>(regToNum(rs1)) << 15;
-        instruction |= bitset<32>(regToNum(rs2)) << 20;
-        instruction |= bitset<32>(imm110to5) << 25;
-        instruction |= bitset<32>(imm112) << 31;
-    }
+// Byte address of the first .data byte; .text starts at 0
+constexpr uint32_t DataBase = 0x10000000;
+
+// Label addresses, keyed by views into the source text
+typedef unordered_map<string_view, uint32_t> SymbolTable;
+
+struct AssembledProgram
+{
+    vector<uint32_t> text;
+    vector<uint8_t> data; // placed at DataBase
+    SymbolTable labels;
 };
 
-class Jtype : public Instruction
+// Where an operand's value goes, which decides what a label means there
+enum class Field : uint8_t
 {
-public:
-    string rd, imm1;
-    Jtype(string opc, string rd, string imm1) : Instruction(opc), rd(rd), imm1(imm1) {}
+    Branch, // 13-bit offset from the instruction
+    Jump,   // 21-bit offset from the instruction
+    Imm12,  // I- and S-type immediate
+    Shift,  // SLLI, SRLI and SRAI shift amount
+    Upper,  // U-type immediate
+    Word    // .word/.half/.byte value
+};
 
-    void toBinaryArray(bitset<32> &instruction) const override
+// Value of an operand: a number, a label, or "%hi(label)" / "%lo(label)",
+// the parts of a label's address for a LUI+ADDI (or LUI+load) pair. A label
+// is an offset from pc for branches and jumps and an address elsewhere.
+// Values must fit their field and branch and jump targets must be
+// instructions, whichever way they are written. A token that starts with a
+// digit or sign is a number, never a label.
+int resolveOperand(string_view token, Field field, const SymbolTable &labels, uint32_t pc)
+{
+    int64_t value;
+    bool symbolic = !parseInteger(token, value);
+    if (symbolic && !token.empty() && (isdigit((unsigned char)token[0]) || token[0] == '-' || token[0] == '+'))
+        throw invalid_argument("bad number '" + string(token) + "'");
+    if (symbolic)
     {
-        instruction = bitset<32>(0x00000000);
-        int imm1Val = imm1ToNum(imm1);
-        int imm20 = (imm1Val >> 20) & 0x1;       // imm1ediate[20]
-        int imm110to1 = (imm1Val >> 1) & 0x3FF;  // imm1ediate[10:1]
-        int imm111 = (imm1Val >> 11) & 0x1;      // imm1ediate[11]
-        int imm119to12 = (imm1Val >> 12) & 0xFF; // imm1ediate[19:12]
+        int part = 0; // 1 for %hi, 2 for %lo
+        if (token.size() > 5 && token[0] == '%' && token[3] == '(' && token.back() == ')')
+        {
+            part = token.substr(1, 2) == "hi" ? 1 : token.substr(1, 2) == "lo" ? 2 : 0;
+            if (part == 0)
+                throw invalid_argument("bad operand '" + string(token) + "'");
+            token = token.substr(4, token.size() - 5);
+        }
+        auto label = labels.find(token);
+        if (label == labels.end())
+            throw invalid_argument("undefined label '" + string(token) + "'");
+        uint32_t address = label->second;
 
-        instruction |= bitset<32>(stoi(opcode, nullptr, 2)) << 0;
-        instruction |= bitset<32>(regToNum(rd)) << 7;
-        instruction |= bitset<32>(imm119to12) << 12;
-        instruction |= bitset<32>(imm111) << 20;
-        instruction |= bitset<32>(imm110to1) << 21;
-        instruction |= bitset<32>(imm20) << 31;
+        if (part == 1)
+            value = (int)((address + 0x800) >> 12);
+        else if (part == 2)
+            value = (int32_t)(address << 20) >> 20;
+        else if (field == Field::Branch || field == Field::Jump)
+            value = (int64_t)address - pc;
+        else if (field == Field::Upper)
+            throw invalid_argument("use %hi(" + string(token) + ") for the upper bits of a label");
+        else
+        {
+            value = (int32_t)address;
+            if ((field == Field::Imm12 || field == Field::Shift) && (value < -2048 || value > 2047))
+                throw invalid_argument("address of '" + string(token) + "' does not fit in 12 bits; use %lo");
+        }
+        if (part != 0 && (field == Field::Branch || field == Field::Jump))
+            throw invalid_argument("bad target '%" + string(part == 1 ? "hi" : "lo") + "(" + string(token) + ")'");
     }
-};
 
-class Utype : public Instruction
+    if (field == Field::Imm12 && (value < -2048 || value > 2047))
+        throw invalid_argument("immediate " + string(token) + " does not fit in 12 bits");
+    if (field == Field::Shift && (value < 0 || value > 31))
+        throw invalid_argument("shift amount " + string(token) + " is not in 0..31");
+    if (field == Field::Upper && (value < -(1 << 19) || value > 0xfffff))
+        throw invalid_argument("immediate " + string(token) + " does not fit in 20 bits");
+    if (field == Field::Word && (value < INT32_MIN || value > UINT32_MAX))
+        throw invalid_argument("value " + string(token) + " does not fit in 32 bits");
+    if (field == Field::Branch || field == Field::Jump)
+    {
+        int64_t limit = field == Field::Branch ? 1 << 12 : 1 << 20;
+        if (value < -limit || value >= limit)
+            throw invalid_argument("target " + string(token) + " is out of range");
+        if (value % 4 != 0 || (int64_t)pc + value < 0)
+            throw invalid_argument("target " + string(token) + " is not an instruction");
+    }
+    return (int)(uint32_t)value;
+}
+
+// Encodes an instruction at byte address pc from its operand tokens
+uint32_t encodeInstruction(const Mnemonic &m, const string_view *operands, int count, const SymbolTable &labels, uint32_t pc)
 {
-public:
-    string rd, imm1;
-    Utype(string opc, string rd, string imm1) : Instruction(opc), rd(rd), imm1(imm1) {}
+    static const int operandCounts[] = {3, 3, 3, 3, 2, 2, 0, 1}; // by Syntax
+    if (count != operandCounts[(int)m.syntax])
+        throw invalid_argument(string(m.name) + " takes " + to_string(operandCounts[(int)m.syntax]) + " operands");
 
-    void toBinaryArray(bitset<32> &instruction) const override
+    uint32_t w = m.opcode | m.func3 << 12 | (uint32_t)m.func7 << 25;
+    switch (m.syntax)
+    {
+    case Syntax::R:
+        w |= parseRegister(operands[0]) << 7 | parseRegister(operands[1]) << 15 | parseRegister(operands[2]) << 20;
+        break;
+    case Syntax::I:
     {
-        instruction = bitset<32>(0x00000000);
-        instruction |= bitset<32>(stoi(opcode, nullptr, 2)) << 0;
-        instruction |= bitset<32>(regToNum(rd)) << 7;
-        instruction |= bitset<32>(imm1ToNum(imm1)) << 12;
+        bool shift = m.opcode == 0b0010011 && (m.func3 & 0b011) == 0b001; // SLLI, SRLI, SRAI
+        w |= parseRegister(operands[0]) << 7 | parseRegister(operands[1]) << 15 |
+             (uint32_t)resolveOperand(operands[2], shift ? Field::Shift : Field::Imm12, labels, pc) << 20;
+        break;
     }
-};
+    case Syntax::S:
+    {
+        uint32_t imm = resolveOperand(operands[2], Field::Imm12, labels, pc);
+        w |= (imm & 0x1f) << 7 | parseRegister(operands[1]) << 15 | parseRegister(operands[0]) << 20 | (imm >> 5 & 0x7f) << 25;
+        break;
+    }
+    case Syntax::B:
+    {
+        uint32_t imm = resolveOperand(operands[2], Field::Branch, labels, pc);
+        w |= (imm >> 11 & 1) << 7 | (imm >> 1 & 0xf) << 8 | parseRegister(operands[0]) << 15 | parseRegister(operands[1]) << 20 |
+             (imm >> 5 & 0x3f) << 25 | (imm >> 12 & 1) << 31;
+        break;
+    }
+    case Syntax::J:
+    {
+        uint32_t imm = resolveOperand(operands[1], Field::Jump, labels, pc);
+        w |= parseRegister(operands[0]) << 7 | (imm >> 12 & 0xff) << 12 | (imm >> 11 & 1) << 20 | (imm >> 1 & 0x3ff) << 21 |
+             (imm >> 20 & 1) << 31;
+        break;
+    }
+    case Syntax::U:
+        w |= parseRegister(operands[0]) << 7 | (uint32_t)resolveOperand(operands[1], Field::Upper, labels, pc) << 12;
+        break;
+    case Syntax::None:
+        break;
+    case Syntax::Counter:
+        w |= parseRegister(operands[0]) << 7 | (uint32_t)m.csr << 20;
+        break;
+    }
+    return w;
+}
 
-class Stype : public Instruction
+// Cursor over the tokens of a line, separated by spaces, tabs or commas
+struct Tokens
 {
-public:
-    string rs1, rs2, imm1;
-    Stype(string opc, string f3, string rs1, string rs2, string imm1)
-        : Instruction(opc, f3), rs1(rs1), rs2(rs2), imm1(imm1) {}
+    string_view rest;
 
-    void toBinaryArray(bitset<32> &instruction) const override
+    // Next token, empty at the end of the line
+    string_view next()
     {
-        instruction = bitset<32>(0x00000000);
-        int imm1Val = imm1ToNum(imm1);
-        int imm1Hi = (imm1Val >> 5) & 0x7F; // High 7 bits
-        int imm1Lo = imm1Val & 0x1F;        // Low 5 bits
-
-        instruction |= bitset<32>(stoi(opcode, nullptr, 2)) << 0;
-        instruction |= bitset<32>(imm1Lo) << 7;
-        instruction |= bitset<32>(stoi(func3, nullptr, 2)) << 12;
-        instruction |= bitset<32>(regToNum(rs1)) << 15;
-        instruction |= bitset<32>(regToNum(rs2)) << 20;
-        instruction |= bitset<32>(imm1Hi) << 25;
+        size_t at = rest.find_first_not_of(" \t\r,");
+        if (at == string_view::npos)
+            return rest = {};
+        size_t end = min(rest.find_first_of(" \t\r,", at), rest.size());
+        string_view token = rest.substr(at, end - at);
+        rest.remove_prefix(end);
+        return token;
     }
 };
 
-class Nop : public Itype
+// Where the next instruction or data byte goes
+struct Layout
 {
-public:
-    Nop() : Itype("0010011", "000", "x0", "x0", "0") {}
+    bool data = false; // in .data rather than .text
+    uint32_t textWords = 0;
+    uint32_t dataBytes = 0;
 };
 
-class assembler
+// Lays out one directive, writing its bytes into out when emit is set. Pass
+// one and pass two both come through here, so they agree on every address.
+void assembleDirective(string_view name, Tokens operands, Layout &at, AssembledProgram &out, bool emit)
 {
-public:
-    assembler()
-    {
-        opcodeMap["ADD"] = "0110011";
-        opcodeMap["SUB"] = "0110011";
-        opcodeMap["MUL"] = "0110011";
-        opcodeMap["DIV"] = "0110011";
-        opcodeMap["REM"] = "0110011";
-        opcodeMap["SLT"] = "0110011";
-        opcodeMap["SLTU"] = "0110011";
-        opcodeMap["AND"] = "0110011";
-        opcodeMap["OR"] = "0110011";
-        opcodeMap["XOR"] = "0110011";
-        opcodeMap["SLL"] = "0110011";
-        opcodeMap["SRL"] = "0110011";
-        opcodeMap["SRA"] = "0110011";
-        opcodeMap["ADDI"] = "0010011";
-        opcodeMap["SLTI"] = "0010011";
-        opcodeMap["SLTIU"] = "0010011";
-        opcodeMap["ANDI"] = "0010011";
-        opcodeMap["ORI"] = "0010011";
-        opcodeMap["XORI"] = "0010011";
-        opcodeMap["SLLI"] = "0010011";
-        opcodeMap["SRLI"] = "0010011";
-        opcodeMap["SRAI"] = "0010011";
-        opcodeMap["LW"] = "0000011";
-        opcodeMap["SW"] = "0100011";
-        opcodeMap["LB"] = "0000011";
-        opcodeMap["LH"] = "0000011";
-        opcodeMap["LBU"] = "0000011";
-        opcodeMap["LHU"] = "0000011";
-        opcodeMap["SB"] = "0100011";
-        opcodeMap["SH"] = "0100011";
-        opcodeMap["BEQ"] = "1100011";
-        opcodeMap["BNE"] = "1100011";
-        opcodeMap["BLT"] = "1100011";
-        opcodeMap["BLTU"] = "1100011";
-        opcodeMap["BGE"] = "1100011";
-        opcodeMap["BGEU"] = "1100011";
-        opcodeMap["JAL"] = "1101111";
-        opcodeMap["JALR"] = "1100111";
-        opcodeMap["LUI"] = "0110111";
-        opcodeMap["AUIPC"] = "0010111";
-        opcodeMap["NOP"] = "0010011";
-
-        // Func3 Map
-        func3Map["ADD"] = "000";
-        func3Map["SUB"] = "000";
-        func3Map["MUL"] = "000";
-        func3Map["DIV"] = "100";
-        func3Map["REM"] = "110";
-        func3Map["SLT"] = "010";
-        func3Map["SLTU"] = "011";
-        func3Map["AND"] = "111";
-        func3Map["OR"] = "110";
-        func3Map["XOR"] = "100";
-        func3Map["SLL"] = "001";
-        func3Map["SRL"] = "101";
-        func3Map["SRA"] = "101";
-        func3Map["ADDI"] = "000";
-        func3Map["SLTI"] = "010";
-        func3Map["SLTIU"] = "011";
-        func3Map["ANDI"] = "111";
-        func3Map["ORI"] = "110";
-        func3Map["XORI"] = "100";
-        func3Map["SLLI"] = "001";
-        func3Map["SRLI"] = "101";
-        func3Map["SRAI"] = "101";
-        func3Map["LW"] = "010";
-        func3Map["SW"] = "010";
-        func3Map["LB"] = "000";
-        func3Map["LH"] = "001";
-        func3Map["LBU"] = "100";
-        func3Map["LHU"] = "101";
-        func3Map["SB"] = "000";
-        func3Map["SH"] = "001";
-        func3Map["BEQ"] = "000";
-        func3Map["BNE"] = "001";
-        func3Map["BLT"] = "100";
-        func3Map["BLTU"] = "110";
-        func3Map["BGE"] = "101";
-        func3Map["BGEU"] = "111";
-        func3Map["JALR"] = "000";
-
-        func7Map["ADD"] = "0000000";
-        func7Map["SUB"] = "0100000";
-        func7Map["MUL"] = "0000001";
-        func7Map["DIV"] = "0000001";
-        func7Map["REM"] = "0000001";
-        func7Map["SLT"] = "0000000";
-        func7Map["SLTU"] = "0000000";
-        func7Map["AND"] = "0000000";
-        func7Map["OR"] = "0000000";
-        func7Map["XOR"] = "0000000";
-        func7Map["SLL"] = "0000000";
-        func7Map["SRL"] = "0000000";
-        func7Map["SRA"] = "0100000";
-        func7Map["NOP"] = "0000000";
-    }
-
-    Instruction *parseInstruction(const string &instruction)
-    {
-        string opcode, func3, func7, subins;
-
-        // Extract the first field (sub-instruction) which is typically the instruction type or name
-        int spacePos = instruction.find(' ');
-        subins = instruction.substr(0, spacePos);
-
-        // Check if the subins is a valid opcode in the map
-        if (opcodeMap.find(subins) != opcodeMap.end())
-        {
-            opcode = opcodeMap[subins];
-            func3 = func3Map[subins];
-            func7 = func7Map[subins];
-
-            // Handle NOP (No operation) instruction
-            if (subins == "NOP")
-            {
-                return parseNOP();
-            }
-
-            // Handle R-type instruction
-            if (opcode == "0110011")
-            {
-                return parseRtype(opcode, func3, func7, instruction);
-            }
-            // Handle I-type, L-type, JALR assemblyLang
-            else if (opcode == "0010011" || opcode == "0000011" || opcode == "1100111")
-            {
-                return parseItype(opcode, func3, instruction);
-            }
-            // Handle S-type instruction
-            else if (opcode == "0100011")
-            {
-                return parseStype(opcode, func3, instruction);
-            }
-            // Handle B-type instruction
-            else if (opcode == "1100011")
-            {
-                return parseBtype(opcode, func3, instruction);
-            }
-            // Handle J-type instruction
-            else if (opcode == "1101111" || opcode == "1100111")
-            {
-                return parseJtype(opcode, instruction);
-            }
-            // Handle U-type instruction
-            else if (opcode == "0110111" || opcode == "0010111")
-            {
-                return parseUtype(opcode, instruction);
-            }
-        }
-
-        return nullptr;
+    if (name == ".text" || name == ".data")
+    {
+        at.data = name == ".data";
+        return;
     }
+    if (name == ".globl" || name == ".global")
+        return;
 
-    unordered_map<string, string> opcodeMap;
-    unordered_map<string, string> func3Map;
-    unordered_map<string, string> func7Map;
-
-    vector<string> splitInstruction(const string &instruction)
+    int width = name == ".word" ? 4 : name == ".half" ? 2 : name == ".byte" ? 1 : 0;
+    if (width)
     {
-        vector<string> parts;
-        int start = 0, end = instruction.find(' ');
-        while (end != string::npos)
+        if (!at.data && width != 4)
+            throw invalid_argument(string(name) + " outside .data");
+        for (string_view token; !(token = operands.next()).empty();)
         {
-            parts.push_back(instruction.substr(start, end - start));
-            start = end + 1;
-            end = instruction.find(' ', start);
+            if (emit)
+            {
+                uint32_t value = resolveOperand(token, Field::Word, out.labels, at.textWords * 4);
+                if (at.data)
+                    for (int i = 0; i < width; i++)
+                        out.data[at.dataBytes + i] = value >> 8 * i;
+                else
+                    out.text[at.textWords] = value;
+            }
+            if (at.data)
+                at.dataBytes += width;
+            else
+                at.textWords++;
         }
-        parts.push_back(instruction.substr(start));
-        return parts;
     }
-
-    Rtype *parseRtype(const string &opcode, const string &func3, const string &func7, const string &instruction)
+    else if (name == ".space" || name == ".zero")
     {
-        vector<string> parts = splitInstruction(instruction);
-        // Assuming subins, rd, rs1, rs2 are in the expected positions
-        string subins = parts[0], rd = parts[1], rs1 = parts[2], rs2 = parts[3];
-        return new Rtype(opcode, func3, func7, rd, rs1, rs2);
+        int bytes = parseImmediate(operands.next());
+        if (!at.data || bytes < 0)
+            throw invalid_argument(string(name) + " needs a non-negative size in .data");
+        at.dataBytes += bytes;
     }
-
-    Itype *parseItype(const string &opcode, const string &func3, const string &instruction)
+    else if (name == ".align")
     {
-        vector<string> parts = splitInstruction(instruction);
-        string subins = parts[0], rd = parts[1], rs1 = parts[2], imm1 = parts[3];
-        return new Itype(opcode, func3, rd, rs1, imm1);
+        int power = parseImmediate(operands.next());
+        if (power < 0 || power > 12 || (!at.data && power > 2))
+            throw invalid_argument("bad alignment " + to_string(power));
+        uint32_t step = 1u << power;
+        if (at.data)
+            at.dataBytes = (at.dataBytes + step - 1) & ~(step - 1);
     }
+    else
+        throw invalid_argument("unknown directive '" + string(name) + "'");
 
-    Stype *parseStype(const string &opcode, const string &func3, const string &instruction)
-    {
-        vector<string> parts = splitInstruction(instruction);
-        string subins = parts[0], rs2 = parts[1], rs1 = parts[2], imm1 = parts[3];
-        return new Stype(opcode, func3, rs1, rs2, imm1);
-    }
+    if (at.dataBytes > 1u << 28)
+        throw invalid_argument(".data is larger than 256 MiB");
+}
+
+bool isLabel(string_view name)
+{
+    auto start = [](char c) { return isalpha((unsigned char)c) || c == '_' || c == '.' || c == '$'; };
+    if (name.empty() || !start(name[0]))
+        return false;
+    for (char c : name)
+        if (!start(c) && !isdigit((unsigned char)c))
+            return false;
+    return true;
+}
 
-    Btype *parseBtype(const string &opcode, const string &func3, const string &instruction)
+// Assembles one line: an optional "label:", then an instruction, a directive
+// or nothing, then an optional '#' comment. Pass one (emit unset) defines
+// the labels and advances the layout; pass two encodes into out.
+void assembleLine(string_view line, Layout &at, AssembledProgram &out, bool emit)
+{
+    Tokens tokens{line.substr(0, line.find('#'))};
+    string_view head = tokens.next();
+    size_t colon = head.find(':');
+    if (colon != string_view::npos)
     {
-        vector<string> parts = splitInstruction(instruction);
-        string subins = parts[0], rs1 = parts[1], rs2 = parts[2], imm1 = parts[3];
-        return new Btype(opcode, func3, rs1, rs2, imm1);
+        string_view label = head.substr(0, colon);
+        if (!isLabel(label))
+            throw invalid_argument("bad label '" + string(label) + "'");
+        if (!emit && !out.labels.emplace(label, at.data ? DataBase + at.dataBytes : at.textWords * 4).second)
+            throw invalid_argument("label '" + string(label) + "' is defined twice");
+        head = head.substr(colon + 1);
+        if (head.empty())
+            head = tokens.next();
     }
+    if (head.empty())
+        return;
+    if (head[0] == '.')
+        return assembleDirective(head, tokens, at, out, emit);
+    if (at.data)
+        throw invalid_argument("instruction '" + string(head) + "' in .data");
 
-    Jtype *parseJtype(const string &opcode, const string &instruction)
+    if (emit)
     {
-        vector<string> parts = splitInstruction(instruction);
-        string subins = parts[0], rd = parts[1], imm1 = parts[2];
-        return new Jtype(opcode, rd, imm1);
+        // Mnemonics are case-insensitive; the table holds them in upper case
+        const Mnemonic *m = findMnemonic(head);
+        if (!m && head.size() <= 16)
+        {
+            char upper[16];
+            for (size_t i = 0; i < head.size(); i++)
+                upper[i] = toupper((unsigned char)head[i]);
+            m = findMnemonic(string_view(upper, head.size()));
+        }
+        if (!m)
+            throw invalid_argument("unknown instruction '" + string(head) + "'");
+
+        string_view operands[4];
+        int count = 0;
+        for (string_view token; !(token = tokens.next()).empty(); count++)
+            if (count < 4)
+                operands[count] = token;
+        out.text[at.textWords] = encodeInstruction(*m, operands, count, out.labels, at.textWords * 4);
     }
+    at.textWords++;
+}
 
-    Utype *parseUtype(const string &opcode, const string &instruction)
+// Assembles source text in two passes. Pass one walks the source once to
+// place every label and size .text and .data, noting the layout at the start
+// of each chunk of lines; pass two then encodes the chunks independently on
+// up to threads threads, each writing its own slice of the output. Errors
+// name the offending line; with several, the first in the source is reported.
+AssembledProgram assembleSource(string_view source, unsigned threads = thread::hardware_concurrency())
+{
+    struct Chunk
     {
-        vector<string> parts = splitInstruction(instruction);
-        string subins = parts[0], rd = parts[1], imm1 = parts[2];
-        return new Utype(opcode, rd, imm1);
-    }
+        string_view text;
+        size_t firstLine;
+        Layout start;
+    };
+    const size_t ChunkBytes = 1 << 18;
+
+    AssembledProgram out;
+    vector<Chunk> chunks;
+    Layout at;
+    size_t lineNumber = 1;
+
+    // Runs a pass over the lines of a chunk, numbering them for errors
+    auto assembleChunk = [&out](string_view text, size_t &number, Layout &layout, bool emit) {
+        for (; !text.empty(); number++)
+        {
+            size_t end = min(text.find('\n'), text.size());
+            assembleLine(text.substr(0, end), layout, out, emit);
+            text.remove_prefix(min(end + 1, text.size()));
+        }
+    };
 
-    Nop *parseNOP()
+    while (!source.empty())
     {
-        return new Nop();
+        size_t cut = source.size() <= ChunkBytes ? string_view::npos : source.find('\n', ChunkBytes);
+        cut = cut == string_view::npos ? source.size() : cut + 1;
+        chunks.push_back(Chunk{source.substr(0, cut), lineNumber, at});
+        source.remove_prefix(cut);
+        try
+        {
+            assembleChunk(chunks.back().text, lineNumber, at, false);
+        }
+        catch (const invalid_argument &ex)
+        {
+            throw runtime_error("line " + to_string(lineNumber) + ": " + ex.what());
+        }
     }
-};
+    out.text.resize(at.textWords);
+    out.data.resize(at.dataBytes);
+
+    vector<string> errors(chunks.size()); // first error of each chunk
+    atomic<size_t> nextChunk{0};
+    auto encodeChunks = [&]() {
+        for (size_t c; (c = nextChunk++) < chunks.size();)
+        {
+            size_t number = chunks[c].firstLine;
+            Layout layout = chunks[c].start;
+            try
+            {
+                assembleChunk(chunks[c].text, number, layout, true);
+            }
+            catch (const invalid_argument &ex)
+            {
+                errors[c] = "line " + to_string(number) + ": " + ex.what();
+            }
+        }
+    };
+    vector<thread> workers;
+    for (unsigned i = 1; i < min<size_t>(max(threads, 1u), chunks.size()); i++)
+        workers.emplace_back(encodeChunks);
+    encodeChunks();
+    for (thread &worker : workers)
+        worker.join();
+
+    for (const string &error : errors)
+        if (!error.empty())
+            throw runtime_error(error);
+    return out;
+}
 
 // CPUPipelineProcessing
 
@@ -389,28 +585,42 @@ class PC
 {
 public:
     int Value;
+    int Wait; // cycles until an instruction cache miss is filled
     bool Valid;
 
     PC(int pc = 0, bool valid = false)
     {
         Value = pc;
+        Wait = 0;
         Valid = valid;
     }
 };
 
+// Front-end guess made when an instruction is fetched. It travels with the
+// instruction so EX can check it and the predictor can roll back to it.
+struct Prediction
+{
+    int NextPc;       // where fetch went after this instruction
+    uint32_t History; // global history before this instruction
+    uint16_t RasTop;  // return stack pointer and top entry before it
+    int RasValue;
+};
+
 class IFID
 {
 public:
     int DPC, NPC;
-    string IR;
+    uint32_t IR;
+    Prediction Pred;
     bool Stall;
     bool Valid;
 
-    IFID(int dpc = 0, int npc = 0, string ir = "", bool stall = false, bool valid = false)
+    IFID(int dpc = 0, int npc = 0, uint32_t ir = 0, bool stall = false, bool valid = false)
     {
         DPC = dpc;
         NPC = npc;
         IR = ir;
+        Pred = Prediction{npc, 0, 0, 0};
         Stall = stall;
         Valid = valid;
     }
@@ -432,7 +642,12 @@ struct ControlWord
     bool Mem2Reg;
     bool Branch;
     bool Jump;
-    int ALUOP;
+    uint8_t ALUOP;
+
+    bool Indirect = false;  // JALR: the target comes from rs1
+    bool PcOperand = false; // AUIPC: the first ALU operand is the PC
+    bool System = false;    // ECALL, carried out when it writes back
+    uint8_t Width = 0;      // func3 of a load or store
 
     ControlWord() : RegRead(false), ALUSrc(false), RegWrite(false), MemRead(false), MemWrite(false), Mem2Reg(false), Branch(false), Jump(false), ALUOP(0)
     {
@@ -444,35 +659,84 @@ struct ControlWord
     }
 };
 
+// Operation selected by ALUControl(), resolved once per decoded instruction
+enum class AluOp : uint8_t
+{
+    AND,
+    OR,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    REM,
+    XOR,
+    SLL,
+    SRL,
+    SRA,
+    SLT,
+    SLTU,
+    MULH,
+    MULHSU,
+    MULHU,
+    DIVU,
+    REMU
+};
+
+// Comparison evaluated by ALUFLAG() for B-type instructions
+enum class BranchCond : uint8_t
+{
+    EQ,
+    NE,
+    LT,
+    GE,
+    LTU,
+    GEU,
+    NEVER
+};
+
 class IDEX
 {
 public:
     PC2 pc2;
     int imm1;
-    string imm2;
-    string FUNC;
+    AluOp ALUSel;
+    BranchCond Cond;
     int RS1;
     int RS2;
     int RS22;
     int RDL;
     ControlWord CW;
-    bool Stall;
     bool Valid;
 
-    IDEX(int dpc = 0, int jpc = 0, int imm1 = 0, string func = "", int rs1 = 0, int rs2 = 0, int rs22 = 0, string imm2 = "", int rdl = 0, ControlWord cw = {}, bool stall = false, bool valid = false)
+    // Sequence number of this instruction, and for sources that were still
+    // in flight at decode, the producing instruction to forward from in EX
+    uint32_t Tag;
+    uint32_t SrcTag1, SrcTag2;
+    uint8_t Src1, Src2;
+    bool Fwd1, Fwd2;
+
+    int8_t Unit; // multi-cycle unit that executes it, -1 for the ALU
+
+    Prediction Pred;
+
+    IDEX(int dpc = 0, int jpc = 0, int imm1 = 0, AluOp aluSel = AluOp::AND, int rs1 = 0, int rs2 = 0, int rs22 = 0, BranchCond cond = BranchCond::NEVER, int rdl = 0, ControlWord cw = {}, bool valid = false)
     {
         pc2.Dpc = dpc;
         pc2.Jpc = jpc;
-        imm1 = imm1;
-        imm2 = imm2;
-        FUNC = func;
+        this->imm1 = imm1;
+        ALUSel = aluSel;
+        Cond = cond;
         RS1 = rs1;
         RS2 = rs2;
         RS22 = rs22;
         RDL = rdl;
         CW = cw;
-        Stall = stall;
         Valid = valid;
+        Tag = SrcTag1 = SrcTag2 = 0;
+        Src1 = Src2 = 0;
+        Fwd1 = Fwd2 = false;
+        Unit = -1;
+        Pred = Prediction{0, 0, 0, 0};
     }
 };
 
@@ -482,17 +746,21 @@ public:
     int ALUOUT;
     int RS2;
     int RDL;
+    int Wait; // cycles the access still has to spend in MEM
+    int Dpc;
+    uint32_t Tag;
     ControlWord CW;
-    bool Stall;
     bool Valid;
 
-    EXMO(int aluout = 0, int rs2 = 0, int rdl = 0, ControlWord cw = {}, bool stall = false, bool valid = false)
+    EXMO(int aluout = 0, int rs2 = 0, int rdl = 0, ControlWord cw = {}, bool valid = false)
     {
         ALUOUT = aluout;
         RS2 = rs2;
         CW = cw;
         RDL = rdl;
-        Stall = stall;
+        Wait = 0;
+        Dpc = 0;
+        Tag = 0;
         Valid = valid;
     }
 };
@@ -501,434 +769,4852 @@ class MOWB
 {
 public:
     int LDOUT, ALUOUT, RDL;
+    int Dpc;
+    uint32_t Tag;
     ControlWord CW;
-    bool Stall;
     bool Valid;
 
-    MOWB(int ldout = 0, int aluout = 0, int rdl = 0, ControlWord cw = {}, bool stall = false, bool valid = false)
+    MOWB(int ldout = 0, int aluout = 0, int rdl = 0, ControlWord cw = {}, bool valid = false)
     {
         LDOUT = ldout;
         ALUOUT = aluout;
         RDL = rdl;
+        Dpc = 0;
+        Tag = 0;
         CW = cw;
-        Stall = stall;
         Valid = valid;
     }
 };
 
-int running = 1;
+// Every pipeline register, PC included. Stages read the current copy and write
+// the next one, and the two are swapped at the clock edge, so a stage never
+// sees a value produced in the same cycle.
+struct alignas(64) PipelineLatches
+{
+    PC pc;
+    IFID ifid;
+    IDEX idex;
+    EXMO exmo;
+    MOWB mowb;
+};
 
-IFID ifid;
-IDEX idex;
-EXMO exmo;
-MOWB mowb;
-PC pc;
+static_assert(is_trivially_copyable<PipelineLatches>::value, "pipeline latches must stay POD");
 
-vector<string> InstructionMemory;
+// Why decode holds an instruction
+enum class StallCause : uint8_t
+{
+    None,
+    Rs1,        // RAW hazard on the first source
+    Rs2,        // RAW hazard on the second source
+    Destination, // WAW hazard on a multiply or divide result
+    Serialize   // ECALL or counter read in flight
+};
 
-struct Registers
+// Signals that cross stages within one cycle (branch redirect from EX,
+// stalls towards the front end). resolveHazards() derives them from the
+// current latches before the stages are evaluated. A stage that is held keeps
+// its input latch and produces nothing; the stage that caused the stall sends
+// a bubble downstream.
+struct HazardSignals
 {
-    int valid = 0;
-    int value = 0;
+    // Outcome of the branch or jump leaving EX this cycle
+    bool Resolve;
+    bool Taken;
+    int Destination;
+
+    bool Redirect;
+    int Target;
+    bool StallID;  // ID held, for the reason in Cause
+    bool StallMEM; // memory access still waiting
+    bool UnitBusy; // multiply or divide waiting for its unit
+    bool HoldEX, HoldID, HoldIF;
+    bool Jump;             // the resolved instruction is a jump
+    StallCause Cause;
 };
-vector<Registers> GPR(32);
 
-vector<int> DM(1024, 0);
+// Event counters of the detailed pipeline
+struct PipelineStats
+{
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;      // retired through WB
+    uint64_t stallCycles = 0;       // ID held, by any of the causes below
+    uint64_t rs1StallCycles = 0;    // RAW hazard on rs1
+    uint64_t rs2StallCycles = 0;    // RAW hazard on rs2 only
+    uint64_t wawStallCycles = 0;    // destination still to be written by a unit
+    uint64_t serializeStallCycles = 0; // waiting for an ECALL or counter read
+    uint64_t memoryStallCycles = 0; // MEM waiting for an access
+    uint64_t fetchStallCycles = 0;  // IF waiting for an instruction cache miss
+    uint64_t unitStallCycles = 0;   // EX waiting for a busy multiplier or divider
+    uint64_t branches = 0;          // branches and jumps resolved in EX
+    uint64_t flushes = 0;           // mispredicted ones
+    uint64_t jumps = 0;             // the jumps among the branches
+    uint64_t jumpFlushes = 0;       // and among the flushes
+};
 
-void fetch()
+// Victim selection of a set-associative cache
+enum class Replacement : uint8_t
 {
-    if (ifid.Stall || !pc.Valid)
-    {
-        ifid.Valid = false;
-        return;
-    }
+    LRU,
+    PLRU, // tree pseudo-LRU, needs a power-of-two number of ways
+    Random
+};
 
-    if (pc.Value >= InstructionMemory.size())
-    {
-        ifid.Valid = false;
-        pc.Valid = false;
-        running = 0;
-        return;
-    }
-    else
-    {
-        ifid.IR = InstructionMemory[pc.Value];
-        ifid.DPC = pc.Value;
-        ifid.NPC = pc.Value + 1;
-        ifid.Valid = true;
-        pc.Value = pc.Value + 1;
-    }
-}
+// Hardware prefetcher attached to a cache
+enum class PrefetcherKind : uint8_t
+{
+    None,
+    NextLine, // the lines following a miss
+    Stream,   // confirmed ascending or descending runs of lines
+    Stride    // constant line stride per PC
+};
 
-int signedExtend(const string &str)
+// Geometry and policies of one cache
+struct CacheConfig
 {
-    bool isNegative = (str[0] == '1');
-    int value = stoi(str, nullptr, 2);
+    size_t sizeBytes = 0; // 0 leaves the cache out
+    int ways = 4;
+    int lineBytes = 32;
+    Replacement replacement = Replacement::LRU;
+    bool writeBack = true;     // otherwise every store is written through
+    bool writeAllocate = true; // fill the line on a store miss
+    int hitLatency = 0;        // extra cycles of a hit
+    int missLatency = 20;      // extra cycles of a miss without a memory backend
+    uint32_t regionBytes = 1024; // granularity of the per-region counters
+    bool profile = false;        // keep the per-PC and per-region counters
+    PrefetcherKind prefetcher = PrefetcherKind::None;
+    int prefetchDegree = 2; // lines fetched ahead per trigger
+};
 
-    if (isNegative)
-    {
-        int numBits = str.size();
-        value -= (1 << numBits);
-    }
+// DRAM organisation and timings, in core cycles
+struct DramConfig
+{
+    int banks = 8;
+    uint32_t rowBytes = 2048;
+    bool openPage = true; // keep the row open after an access
+    int tRCD = 14;        // activate to column command
+    int tCAS = 14;        // column command to data
+    int tRP = 14;         // precharge
+    int tBurst = 4;       // data transfer of one line on the shared bus
+};
 
-    return value;
+// Backend behind the L1 caches. With neither an L2 nor DRAM, L1 misses
+// take the flat CacheConfig::missLatency.
+struct MemoryConfig
+{
+    CacheConfig l2;   // shared by instructions and data; size 0 for none
+    bool dram = false; // model DRAM timing; otherwise L2 misses are flat
+    DramConfig dramTiming;
+    int mshrs = 8; // L1 misses that can be outstanding at once
+};
+
+// Direction predictor used by fetch
+enum class PredictorKind : uint8_t
+{
+    None,      // always fall through, every taken branch flushes
+    Static,    // backward taken, forward not taken
+    Bimodal,   // 2-bit counters indexed by PC
+    Gshare,    // 2-bit counters indexed by PC xor global history
+    Tournament // bimodal and gshare, chosen per PC by 2-bit counters
+};
+
+// Timing of the multiplier or the divider. An operation has its result
+// latency cycles after entering EX, and the unit accepts a new one every
+// interval cycles: 1 for a pipelined multiplier, the latency for an iterative
+// divider. With both at 1 the operation stays in the single-cycle ALU.
+struct FunctionalUnitConfig
+{
+    int latency = 1;
+    int interval = 1;
+};
+
+// Timing parameters of a core
+struct CoreConfig
+{
+    int memoryLatency = 0; // extra cycles a load or store spends in MEM
+
+    // Bypass paths. Without EX->EX and MEM->EX a consumer waits in ID until
+    // its producer has written back; WB->ID lets decode read a value in the
+    // cycle it is written.
+    bool forwardEXtoEX = false;  // EXMO result into the next instruction's EX
+    bool forwardMEMtoEX = false; // MOWB result (ALU or load) into EX
+    bool forwardWBtoID = true;
+
+    PredictorKind predictor = PredictorKind::None;
+    int predictorBits = 10; // log2 of the counter table sizes
+    int historyBits = 10;   // global history length for gshare
+    int btbEntries = 256;   // direct-mapped, power of two
+    int rasDepth = 16;
+
+    FunctionalUnitConfig multiplier; // MUL, MULH, MULHSU, MULHU
+    FunctionalUnitConfig divider;    // DIV, DIVU, REM, REMU
+
+    CacheConfig icache;
+    CacheConfig dcache;
+    MemoryConfig memory; // where the L1 caches miss to
+    bool skipIdle = true;  // let run() jump over cycles in which only a countdown changes
+    bool profileCycles = false; // charge every cycle to a PC and a call stack
+};
+
+// Handler used by the functional simulator, chosen from the format
+enum class ExecClass : uint8_t
+{
+    AluReg,
+    AluImm,
+    Load,
+    Store,
+    Branch,
+    Jump,  // JAL and JALR
+    Auipc,
+    System,
+    Invalid // also anything whose only effect is a write to x0
+};
+
+// Fields of an instruction word, extracted once when the program is loaded so
+// that decode() only indexes this table instead of slicing bit strings.
+struct DecodedInst
+{
+    uint8_t opcode;
+    uint8_t format;
+    uint8_t rd, rs1, rs2;
+    uint8_t func3, func7;
+    int imm;
+    ControlWord CW;
+    AluOp ALUSel;
+    BranchCond Cond;
+    ExecClass Class;
+};
+
+int signedExtend(uint32_t value, int numBits)
+{
+    if (value & (1u << (numBits - 1)))
+        return (int)value - (1 << numBits);
+
+    return (int)value;
 }
 
-pair<ControlWord, string> controller(string opcode)
+pair<ControlWord, char> controller(uint32_t opcode)
 {
     // cw ALUSrc,regRead, regWrite, ALUOP,mem2Reg,memRead,memWrite,branch,jump
 
-    if (opcode == "0110011") // R-type
-    {
-        return {ControlWord(false, true, true, 2, false, false, false, false, false), "R"};
-    }
-    else if (opcode == "0010011") // I-Type
+    switch (opcode)
     {
-        return {ControlWord(true, true, true, 3, false, false, false, false, false), "I"};
-    }
-    else if (opcode == "0000011") // L-type
+    case 0b0110011: // R-type
+        return {ControlWord(false, true, true, 2, false, false, false, false, false), 'R'};
+    case 0b0010011: // I-Type
+        return {ControlWord(true, true, true, 3, false, false, false, false, false), 'I'};
+    case 0b0000011: // L-type
+        return {ControlWord(true, true, true, 0, true, true, false, false, false), 'L'};
+    case 0b0100011: // S-type
+        return {ControlWord(true, true, false, 0, false, false, true, false, false), 'S'};
+    case 0b1100011: // B-type
+        return {ControlWord(false, true, false, 1, false, false, false, true, false), 'B'};
+    case 0b1101111: // j-type
+        return {ControlWord(true, false, true, 0, false, false, false, false, true), 'J'};
+    case 0b1100111: // JALR, I-type encoding
     {
-        return {ControlWord(true, true, true, 0, true, true, false, false, false), "L"};
+        ControlWord cw(true, true, true, 0, false, false, false, false, true);
+        cw.Indirect = true;
+        return {cw, 'J'};
     }
-    else if (opcode == "0100011") // S-type
+    case 0b0110111: // LUI, adds the immediate to x0
+        return {ControlWord(true, true, true, 0, false, false, false, false, false), 'U'};
+    case 0b0010111: // AUIPC
     {
-        return {ControlWord(true, true, false, 0, false, false, true, false, false), "S"};
+        ControlWord cw(true, false, true, 0, false, false, false, false, false);
+        cw.PcOperand = true;
+        return {cw, 'U'};
     }
-    else if (opcode == "1100011") // B-type
+    case 0b1110011: // ECALL, or a CSR instruction reading a counter
     {
-        return {ControlWord(false, true, false, 1, false, false, false, true, false), "B"};
+        ControlWord cw(false, false, true, 0, false, false, false, false, false);
+        cw.System = true;
+        return {cw, 'E'};
     }
-    else if (opcode == "1101111") // j-type
-    {
-        return {ControlWord(true, true, true, 0, false, false, false, false, true), "J"};
     }
 
-    return {ControlWord(false, false, false, 0, false, false, false, false, false), "NA"};
+    return {ControlWord(false, false, false, 0, false, false, false, false, false), 'N'};
 }
 
-int genImm(const string &ir, const string &opcode)
+int genImm(uint32_t ir, uint32_t opcode)
 {
     int imm1 = INT_MIN;
-    if (opcode == "0010011" || opcode == "0000011")
-    {
-        string temp = ir.substr(0, 12);
-        imm1 = signedExtend(temp);
-    }
-    else if (opcode == "0100011")
-    {
-        string temp = ir.substr(0, 7) + ir.substr(20, 5);
-        imm1 = signedExtend(temp);
-    }
-    else if (opcode == "1100011")
+    if (opcode == 0b0010011 || opcode == 0b0000011 || opcode == 0b1100111 || opcode == 0b1110011)
     {
-        string temp = ir.substr(0, 1) + ir.substr(24, 1) + ir.substr(1, 6) + ir.substr(20, 4);
-        imm1 = signedExtend(temp);
+        imm1 = signedExtend(ir >> 20, 12);
     }
-
-    return imm1;
-}
-
-void decode()
-{
-    if (idex.Stall || !ifid.Valid)
+    else if (opcode == 0b0100011)
     {
-        idex.Valid = false;
-        return;
+        imm1 = signedExtend(((ir >> 25) << 5) | ((ir >> 7) & 0x1F), 12);
     }
-
-    string opcode = ifid.IR.substr(25, 7);
-    auto res = controller(opcode);
-    idex.CW = res.first;
-    string format = res.second;
-
-    idex.pc2.Dpc = ifid.DPC;
-
-    idex.imm1 = genImm(ifid.IR, opcode);
-
-    idex.FUNC = ifid.IR.substr(17, 3);
-    idex.imm2 = ifid.IR.substr(0, 7);
-
-    string rdl = ifid.IR.substr(20, 5);
-    idex.RDL = stoi(rdl, 0, 2);
-
-    string rsl1 = ifid.IR.substr(12, 5);
-    int rl1 = stoi(rsl1, 0, 2);
-
-    string rsl2 = ifid.IR.substr(7, 5);
-    int rl2 = stoi(rsl2, 0, 2);
-
-    ifid.Stall = false;
-
-    if (idex.CW.RegRead)
+    else if (opcode == 0b1100011)
     {
-        if (GPR[rl1].valid == 0)
-            idex.RS1 = GPR[rl1].value;
-        else
-        {
-            ifid.Stall = true;
-            idex.Valid = false;
-            return;
-        }
+        // imm[12|11|10:5|4:1], kept in units of two bytes like the encoding
+        uint32_t temp = ((ir >> 31) << 11) | (((ir >> 7) & 0x1) << 10) | (((ir >> 25) & 0x3F) << 4) | ((ir >> 8) & 0xF);
+        imm1 = signedExtend(temp, 12);
     }
-
-    if (idex.CW.ALUSrc)
+    else if (opcode == 0b1101111)
     {
-        if (idex.CW.RegRead)
-        {
-            idex.RS2 = idex.imm1;
-            if (GPR[rl2].valid == 0)
-                idex.RS22 = GPR[rl2].value;
-            else
-            {
-                ifid.Stall = true;
-                idex.Valid = false;
-                return;
-            }
-        }
+        // imm[20|10:1|11|19:12], in the same two-byte units
+        uint32_t temp = ((ir >> 31) << 19) | (((ir >> 12) & 0xFF) << 11) | (((ir >> 20) & 0x1) << 10) | ((ir >> 21) & 0x3FF);
+        imm1 = signedExtend(temp, 20);
     }
-    else if (idex.CW.RegRead)
+    else if (opcode == 0b0110111 || opcode == 0b0010111)
     {
-        if (GPR[rl2].valid == 0)
-            idex.RS2 = GPR[rl2].value;
-        else
-        {
-            ifid.Stall = true;
-            idex.Valid = false;
-            return;
-        }
+        imm1 = (int)(ir & 0xFFFFF000);
     }
 
-    if (opcode != "0100011" && opcode != "1100011")
-        GPR[idex.RDL].valid += 1;
-
-    ifid.Stall = false;
-    idex.Valid = true;
+    return imm1;
 }
 
-string ALUControl(string func7, string func3, int ALUOP)
+AluOp ALUControl(int func7, int func3, int ALUOP)
 {
+    // By func3, for func7 = 0 and for the M extension
+    static const AluOp base[8] = {AluOp::ADD, AluOp::SLL, AluOp::SLT, AluOp::SLTU, AluOp::XOR, AluOp::SRL, AluOp::OR, AluOp::AND};
+    static const AluOp multiply[8] = {AluOp::MUL, AluOp::MULH, AluOp::MULHSU, AluOp::MULHU, AluOp::DIV, AluOp::DIVU, AluOp::REM, AluOp::REMU};
+
     if (ALUOP == 0)
     {
-        return "0010";
+        return AluOp::ADD;
     }
     else if (ALUOP == 1)
     {
-        return "0110";
+        return AluOp::SUB;
     }
     else if (ALUOP == 2)
     {
-        if (func7 == "0000000")
-        {
-            if (func3 == "111")
-                return "0000";
-            if (func3 == "110")
-                return "0001";
-            return "0010";
-        }
-        else if (func7 == "0100000")
-        {
-            return "0110";
-        }
-        else if (func7 == "0000001")
-        {
-            if (func3 == "000")
-            {
-                return "1000";
-            }
-            if (func3 == "100")
-            {
-                return "1100";
-            }
-            if (func3 == "110")
-            {
-                return "1110";
-            }
-        }
+        if (func7 == 0b0100000)
+            return func3 == 0b101 ? AluOp::SRA : AluOp::SUB;
+        if (func7 == 0b0000001)
+            return multiply[func3];
+        return base[func3];
     }
     else if (ALUOP == 3)
     {
-        if (func3 == "000")
-            return "0010";
-        if (func3 == "111")
-            return "0000";
-        if (func3 == "110")
-            return "0001";
+        // SRAI carries SRA's func7 in the upper immediate bits
+        if (func3 == 0b101 && func7 == 0b0100000)
+            return AluOp::SRA;
+        return base[func3];
     }
-    return "0000";
+    return AluOp::AND;
 }
 
-int ALU(const string &ALUSelect, int rs1, int rs2)
+// Arithmetic wraps around, shifts use the low five bits of rs2, and division
+// never traps: by zero it gives all ones or the dividend, and INT_MIN / -1
+// overflows to INT_MIN
+int ALU(AluOp ALUSelect, int rs1, int rs2)
 {
-    if (ALUSelect == "0000")
+    uint32_t a = rs1, b = rs2;
+
+    switch (ALUSelect)
+    {
+    case AluOp::AND:
         return rs1 & rs2;
-    if (ALUSelect == "0001")
+    case AluOp::OR:
         return rs1 | rs2;
-    if (ALUSelect == "0010")
-        return rs1 + rs2;
-    if (ALUSelect == "1000")
-        return rs1 * rs2;
-    if (ALUSelect == "1100")
-        return rs1 / rs2;
-    if (ALUSelect == "1110")
-        return rs1 % rs2;
+    case AluOp::XOR:
+        return rs1 ^ rs2;
+    case AluOp::ADD:
+        return (int)(a + b);
+    case AluOp::SLL:
+        return (int)(a << (b & 31));
+    case AluOp::SRL:
+        return (int)(a >> (b & 31));
+    case AluOp::SRA:
+        return rs1 >> (b & 31);
+    case AluOp::SLT:
+        return rs1 < rs2;
+    case AluOp::SLTU:
+        return a < b;
+    case AluOp::MUL:
+        return (int)(a * b);
+    case AluOp::MULH:
+        return (int)(((int64_t)rs1 * rs2) >> 32);
+    case AluOp::MULHSU:
+        return (int)(((int64_t)rs1 * (int64_t)b) >> 32);
+    case AluOp::MULHU:
+        return (int)(((uint64_t)a * b) >> 32);
+    case AluOp::DIV:
+        if (rs2 == 0)
+            return -1;
+        return rs2 == -1 ? (int)(0 - a) : rs1 / rs2;
+    case AluOp::DIVU:
+        return b == 0 ? -1 : (int)(a / b);
+    case AluOp::REM:
+        if (rs2 == 0)
+            return rs1;
+        return rs2 == -1 ? 0 : rs1 % rs2;
+    case AluOp::REMU:
+        return b == 0 ? rs1 : (int)(a % b);
+    case AluOp::SUB:
+        break;
+    }
 
-    return rs1 - rs2;
+    return (int)(a - b);
 }
 
-int ALUFLAG(int a, int b, const string &s)
+BranchCond branchCondition(int func3)
 {
-    unsigned ua = a, ub = b;
-
-    if ((s == "000" && a == b) || (s == "001" && a != b) || (s == "100" && a < b) || (s == "101" && a >= b) || (s == "110" && ua < ub) || (s == "111" && ua >= ub))
-        return 1;
-
-    return 0;
+    switch (func3)
+    {
+    case 0b000:
+        return BranchCond::EQ;
+    case 0b001:
+        return BranchCond::NE;
+    case 0b100:
+        return BranchCond::LT;
+    case 0b101:
+        return BranchCond::GE;
+    case 0b110:
+        return BranchCond::LTU;
+    case 0b111:
+        return BranchCond::GEU;
+    }
+    return BranchCond::NEVER;
 }
 
-void execute()
+int ALUFLAG(int a, int b, BranchCond s)
 {
-    if (exmo.Stall || !idex.Valid)
+    unsigned ua = a, ub = b;
+
+    switch (s)
+    {
+    case BranchCond::EQ:
+        return a == b;
+    case BranchCond::NE:
+        return a != b;
+    case BranchCond::LT:
+        return a < b;
+    case BranchCond::GE:
+        return a >= b;
+    case BranchCond::LTU:
+        return ua < ub;
+    case BranchCond::GEU:
+        return ua >= ub;
+    case BranchCond::NEVER:
+        break;
+    }
+
+    return 0;
+}
+
+DecodedInst predecode(uint32_t ir)
+{
+    DecodedInst d;
+    d.opcode = ir & 0x7F;
+    d.rd = (ir >> 7) & 0x1F;
+    d.func3 = (ir >> 12) & 0x7;
+    d.rs1 = (ir >> 15) & 0x1F;
+    d.rs2 = (ir >> 20) & 0x1F;
+    d.func7 = ir >> 25;
+    d.imm = genImm(ir, d.opcode);
+
+    auto res = controller(d.opcode);
+    d.CW = res.first;
+    d.format = res.second;
+
+    d.ALUSel = ALUControl(d.func7, d.func3, d.CW.ALUOP);
+    d.Cond = d.CW.Branch ? branchCondition(d.func3) : BranchCond::NEVER;
+    if (d.CW.MemRead || d.CW.MemWrite)
+        d.CW.Width = d.func3;
+
+    // Fields that hold immediate bits read as x0, so they never look like a
+    // dependency, and x0 is never written. ECALL returns its result in a0;
+    // the counters are read-only, so what a CSR instruction would write
+    // does not matter.
+    if (d.format != 'R' && d.format != 'S' && d.format != 'B')
+        d.rs2 = 0;
+    if (d.format == 'U' || d.format == 'E' || d.opcode == 0b1101111)
+        d.rs1 = 0;
+    if (d.format == 'E' && d.func3 == 0)
+        d.rd = 10;
+    if (d.rd == 0 && d.CW.RegWrite)
+        d.CW.RegWrite = false;
+
+    switch (d.format)
+    {
+    case 'R':
+        d.Class = ExecClass::AluReg;
+        break;
+    case 'I':
+        d.Class = ExecClass::AluImm;
+        break;
+    case 'L':
+        d.Class = ExecClass::Load;
+        break;
+    case 'S':
+        d.Class = ExecClass::Store;
+        break;
+    case 'B':
+        d.Class = ExecClass::Branch;
+        break;
+    case 'J':
+        d.Class = ExecClass::Jump;
+        break;
+    case 'U':
+        d.Class = d.CW.PcOperand ? ExecClass::Auipc : ExecClass::AluImm;
+        break;
+    case 'E':
+        d.Class = ExecClass::System;
+        break;
+    default:
+        d.Class = ExecClass::Invalid;
+    }
+    if (!d.CW.RegWrite && d.Class != ExecClass::Jump && d.Class != ExecClass::Store && d.Class != ExecClass::Branch)
+        d.Class = ExecClass::Invalid;
+    return d;
+}
+
+// Assembler name of a decoded instruction
+string mnemonic(const DecodedInst &d)
+{
+    static const char *const alu[] = {"AND", "OR", "ADD", "SUB", "MUL", "DIV", "REM", "XOR", "SLL", "SRL", "SRA",
+                                      "SLT", "SLTU", "MULH", "MULHSU", "MULHU", "DIVU", "REMU"};
+    static const char *const loads[] = {"LB", "LH", "LW", "UNKNOWN", "LBU", "LHU", "UNKNOWN", "UNKNOWN"};
+    static const char *const stores[] = {"SB", "SH", "SW", "UNKNOWN", "UNKNOWN", "UNKNOWN", "UNKNOWN", "UNKNOWN"};
+    static const char *const branches[] = {"BEQ", "BNE", "UNKNOWN", "UNKNOWN", "BLT", "BGE", "BLTU", "BGEU"};
+    static const char *const system[] = {"ECALL", "CSRRW", "CSRRS", "CSRRC", "UNKNOWN", "CSRRWI", "CSRRSI", "CSRRCI"};
+
+    switch (d.opcode)
+    {
+    case 0b0110011:
+        return alu[(int)d.ALUSel];
+    case 0b0010011:
+        return d.ALUSel == AluOp::SLTU ? "SLTIU" : string(alu[(int)d.ALUSel]) + "I";
+    case 0b0000011:
+        return loads[d.func3];
+    case 0b0100011:
+        return stores[d.func3];
+    case 0b1100011:
+        return branches[d.func3];
+    case 0b1101111:
+        return "JAL";
+    case 0b1100111:
+        return "JALR";
+    case 0b0110111:
+        return "LUI";
+    case 0b0010111:
+        return "AUIPC";
+    case 0b1110011:
+        return system[d.func3];
+    }
+    return "UNKNOWN";
+}
+
+// B- and J-type immediates count two-byte units and the PC counts instructions
+int branchTarget(int pc, int imm)
+{
+    return imm * 2 / 4 + pc;
+}
+
+// Register file entry with its scoreboard state: the number of in-flight
+// writers and the tag of the youngest one
+struct Registers
+{
+    int valid = 0;
+    int value = 0;
+    uint32_t producer = 0;
+};
+
+// Read-only mapping of a whole file. Programs loaded from it point into the
+// mapping, so it lives as long as any of them.
+class MappedFile
+{
+public:
+    explicit MappedFile(const string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw runtime_error("cannot open " + path);
+        struct stat info = {};
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void *addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                bytes = (const uint8_t *)addr;
+                length = info.st_size;
+            }
+        }
+        close(fd);
+        if (!bytes && info.st_size > 0)
+            throw runtime_error("cannot map " + path);
+    }
+
+    ~MappedFile()
+    {
+        if (bytes)
+            munmap((void *)bytes, length);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t *bytes = nullptr;
+    size_t length = 0;
+};
+
+// Part of a loaded image that starts out in data memory. The bytes stay in
+// the image; fileSize..memSize reads as zero.
+struct Segment
+{
+    uint32_t vaddr;
+    const uint8_t *data;
+    uint32_t fileSize;
+    uint32_t memSize;
+};
+
+// Assembled program and its pre-decoded form. It is never modified after
+// construction, so any number of cores can share one instance. Code is
+// immutable to the guest too: a store to a text address only changes data
+// memory, so threaded code and translated blocks never go stale.
+class Program
+{
+public:
+    vector<uint32_t> InstructionMemory;
+    vector<DecodedInst> DecodedMemory;
+
+    uint32_t TextBase = 0; // byte address of InstructionMemory[0]
+    int Entry = 0;         // index of the first instruction to run
+    vector<Segment> Segments;
+    shared_ptr<const void> Image; // keeps the bytes behind Segments alive
+    map<uint32_t, string> Symbols; // function names by address, from the ELF symbol table or labels
+
+    explicit Program(vector<uint32_t> binaryInst) : InstructionMemory(move(binaryInst))
+    {
+        DecodedMemory.reserve(InstructionMemory.size());
+        for (uint32_t inp : InstructionMemory)
+            DecodedMemory.push_back(predecode(inp));
+    }
+
+    // Pre-decodes little-endian instruction words straight from an image
+    Program(const uint8_t *text, size_t bytes, uint32_t base)
+        : TextBase(base)
+    {
+        InstructionMemory.reserve(bytes / 4);
+        DecodedMemory.reserve(bytes / 4);
+        for (size_t i = 0; i + 4 <= bytes; i += 4)
+        {
+            uint32_t word = text[i] | text[i + 1] << 8 | text[i + 2] << 16 | (uint32_t)text[i + 3] << 24;
+            InstructionMemory.push_back(word);
+            DecodedMemory.push_back(predecode(word));
+        }
+    }
+
+    // Byte address of an instruction index
+    uint32_t textAddress(int index) const { return TextBase + (uint32_t)index * 4; }
+
+    // Instruction index of a byte address; -1 if no instruction starts there
+    int textIndex(uint32_t addr) const
+    {
+        uint32_t offset = addr - TextBase;
+        if (offset % 4 != 0 || offset / 4 >= InstructionMemory.size())
+            return -1;
+        return (int)(offset / 4);
+    }
+
+    // Name of the function starting at an instruction index: its symbol, or
+    // else its byte address
+    string functionName(int index) const
+    {
+        uint32_t addr = textAddress(index);
+        auto symbol = Symbols.find(addr);
+        if (symbol != Symbols.end())
+            return symbol->second;
+        char name[16];
+        snprintf(name, sizeof(name), "0x%08x", addr);
+        return name;
+    }
+};
+
+// FNV-1a hash of a program's instructions and layout, which a snapshot
+// records to refuse being restored onto a different program
+uint64_t programFingerprint(const Program &program)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&](uint32_t word)
+    {
+        for (int i = 0; i < 4; i++)
+            hash = (hash ^ (word >> (8 * i) & 0xff)) * 0x100000001b3ull;
+    };
+    mix(program.TextBase);
+    mix(program.Entry);
+    for (uint32_t word : program.InstructionMemory)
+        mix(word);
+    return hash;
+}
+
+// Sparse 32-bit guest address space made of 4 KiB pages. A page is only
+// allocated when it is first written; reads of untouched memory see a shared
+// zero page. A small direct-mapped TLB remembers the host page of recent
+// accesses so the hot path skips the two-level page table. Multi-byte
+// accesses are little-endian and may be unaligned.
+class PagedMemory
+{
+public:
+    static constexpr int PageBits = 12;
+    static constexpr uint32_t PageSize = 1u << PageBits;
+
+    PagedMemory() { flushTlb(); }
+
+    uint8_t read8(uint32_t addr) { return readPage(addr)[addr & PageMask]; }
+
+    uint16_t read16(uint32_t addr)
+    {
+        if ((addr & PageMask) > PageSize - 2)
+            return read8(addr) | read8(addr + 1) << 8;
+        const uint8_t *p = readPage(addr) + (addr & PageMask);
+        return p[0] | p[1] << 8;
+    }
+
+    uint32_t read32(uint32_t addr)
+    {
+        if ((addr & PageMask) > PageSize - 4)
+            return read16(addr) | (uint32_t)read16(addr + 2) << 16;
+        const uint8_t *p = readPage(addr) + (addr & PageMask);
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+
+    void write8(uint32_t addr, uint8_t value) { writePage(addr)[addr & PageMask] = value; }
+
+    void write16(uint32_t addr, uint16_t value)
+    {
+        if ((addr & PageMask) > PageSize - 2)
+        {
+            write8(addr, value);
+            write8(addr + 1, value >> 8);
+            return;
+        }
+        uint8_t *p = writePage(addr) + (addr & PageMask);
+        p[0] = value;
+        p[1] = value >> 8;
+    }
+
+    void write32(uint32_t addr, uint32_t value)
+    {
+        if ((addr & PageMask) > PageSize - 4)
+        {
+            write16(addr, value);
+            write16(addr + 2, value >> 16);
+            return;
+        }
+        uint8_t *p = writePage(addr) + (addr & PageMask);
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        p[3] = value >> 24;
+    }
+
+    // RISC-V loads and stores, with the width and signedness of their func3
+    int load(uint32_t addr, int func3)
+    {
+        switch (func3)
+        {
+        case 0b000:
+            return (int8_t)read8(addr);
+        case 0b001:
+            return (int16_t)read16(addr);
+        case 0b100:
+            return read8(addr);
+        case 0b101:
+            return read16(addr);
+        }
+        return (int)read32(addr);
+    }
+
+    void store(uint32_t addr, int func3, int value)
+    {
+        if (func3 == 0b000)
+            write8(addr, value);
+        else if (func3 == 0b001)
+            write16(addr, value);
+        else
+            write32(addr, value);
+    }
+
+    // Drops every page. They are kept for reuse, so a core running job
+    // after job does not go back to the allocator.
+    void clear()
+    {
+        for (auto &table : directory)
+        {
+            if (!table)
+                continue;
+            for (auto &page : *table)
+            {
+                if (page.owned)
+                    freePages.push_back(move(page.owned));
+                page.shared = nullptr;
+            }
+        }
+        resident = 0;
+        flushTlb();
+    }
+
+    // Pages this memory owns a copy of: written ones, as opposed to those
+    // still read from a mapped image or never touched
+    size_t residentPages() const { return resident; }
+
+    // Places size bytes of an external image at addr, followed by zeroes up
+    // to memSize. Pages the image covers completely are read from it in
+    // place and only copied when first written; the image must outlive the
+    // mapping.
+    void map(uint32_t addr, const uint8_t *data, uint32_t size, uint32_t memSize)
+    {
+        uint64_t end = (uint64_t)addr + size;
+        uint64_t at = addr;
+        while (at < end)
+        {
+            uint64_t pageEnd = (at | PageMask) + 1;
+            if ((at & PageMask) == 0 && pageEnd <= end)
+            {
+                PageEntry &entry = slot((uint32_t)(at >> PageBits));
+                if (entry.owned)
+                {
+                    freePages.push_back(move(entry.owned));
+                    resident--;
+                }
+                entry.shared = data + (at - addr);
+            }
+            else
+                for (uint64_t b = at; b < min(pageEnd, end); b++)
+                    write8((uint32_t)b, data[b - addr]);
+            at = pageEnd;
+        }
+        // the tail of a partly initialised page may hold older bytes
+        for (uint64_t b = end; b < (uint64_t)addr + memSize && (b & PageMask) != 0; b++)
+            write8((uint32_t)b, 0);
+        flushTlb();
+    }
+
+    // Calls visit(base address, page bytes) for each page that is not all
+    // zero by construction, in address order
+    template <class Visit>
+    void forEachPage(Visit visit) const
+    {
+        for (uint32_t dir = 0; dir < directory.size(); dir++)
+        {
+            if (!directory[dir])
+                continue;
+            for (uint32_t i = 0; i < TableSize; i++)
+                if (const uint8_t *data = (*directory[dir])[i].data())
+                    visit((dir * TableSize + i) << PageBits, data);
+        }
+    }
+
+private:
+    typedef array<uint8_t, PageSize> Page;
+    static constexpr uint32_t PageMask = PageSize - 1;
+    static constexpr uint32_t TableSize = 1024; // pages per second-level table
+    static constexpr int TlbEntries = 64;
+
+    // A page is private once written; until then it may read through to
+    // a mapped image
+    struct PageEntry
+    {
+        unique_ptr<Page> owned;
+        const uint8_t *shared = nullptr;
+
+        const uint8_t *data() const { return owned ? owned->data() : shared; }
+    };
+
+    struct TlbEntry
+    {
+        uint32_t vpn;
+        const uint8_t *read;
+        uint8_t *write; // nullptr while the zero page stands in
+    };
+
+    static const uint8_t *zeroPage()
+    {
+        static const Page zero{};
+        return zero.data();
+    }
+
+    void flushTlb()
+    {
+        for (TlbEntry &entry : tlb)
+            entry = TlbEntry{UINT32_MAX, nullptr, nullptr};
+    }
+
+    const PageEntry *lookup(uint32_t vpn) const
+    {
+        const auto &table = directory[vpn / TableSize];
+        return table ? &(*table)[vpn % TableSize] : nullptr;
+    }
+
+    PageEntry &slot(uint32_t vpn)
+    {
+        auto &table = directory[vpn / TableSize];
+        if (!table)
+            table.reset(new array<PageEntry, TableSize>());
+        return (*table)[vpn % TableSize];
+    }
+
+    const uint8_t *readPage(uint32_t addr)
+    {
+        uint32_t vpn = addr >> PageBits;
+        TlbEntry &entry = tlb[vpn % TlbEntries];
+        if (entry.vpn != vpn)
+        {
+            const PageEntry *page = lookup(vpn);
+            const uint8_t *data = page ? page->data() : nullptr;
+            entry = TlbEntry{vpn, data ? data : zeroPage(), page && page->owned ? page->owned->data() : nullptr};
+        }
+        return entry.read;
+    }
+
+    uint8_t *writePage(uint32_t addr)
+    {
+        uint32_t vpn = addr >> PageBits;
+        TlbEntry &entry = tlb[vpn % TlbEntries];
+        if (entry.vpn != vpn || !entry.write)
+        {
+            PageEntry &page = slot(vpn);
+            if (!page.owned)
+            {
+                if (freePages.empty())
+                    page.owned.reset(new Page());
+                else
+                {
+                    page.owned = move(freePages.back());
+                    freePages.pop_back();
+                }
+                // copy on write from the image, or start from zero
+                if (page.shared)
+                    memcpy(page.owned->data(), page.shared, PageSize);
+                else
+                    page.owned->fill(0);
+                page.shared = nullptr;
+                resident++;
+            }
+            entry = TlbEntry{vpn, page.owned->data(), page.owned->data()};
+        }
+        return entry.write;
+    }
+
+    array<unique_ptr<array<PageEntry, TableSize>>, (1u << (32 - PageBits)) / TableSize> directory;
+    vector<unique_ptr<Page>> freePages;
+    size_t resident = 0;
+    TlbEntry tlb[TlbEntries];
+};
+
+// Translation cache
+
+struct MicroOp;
+typedef void (*MicroFn)(Registers *gpr, PagedMemory *dm, const MicroOp *op);
+
+// One translated instruction of a basic block. A fused pair covers this op
+// and the next one with a single handler call.
+struct MicroOp
+{
+    MicroFn run;
+    uint8_t kernel;
+    uint8_t length;
+    uint8_t rd, rs1, rs2;
+    int imm;
+};
+
+template <AluOp OP>
+void aluRegKernel(Registers *gpr, PagedMemory *, const MicroOp *op)
+{
+    gpr[op->rd].value = ALU(OP, gpr[op->rs1].value, gpr[op->rs2].value);
+}
+
+template <AluOp OP>
+void aluImmKernel(Registers *gpr, PagedMemory *, const MicroOp *op)
+{
+    gpr[op->rd].value = ALU(OP, gpr[op->rs1].value, op->imm);
+}
+
+template <int FUNC3>
+void loadKernel(Registers *gpr, PagedMemory *dm, const MicroOp *op)
+{
+    gpr[op->rd].value = dm->load((uint32_t)gpr[op->rs1].value + op->imm, FUNC3);
+}
+
+template <int FUNC3>
+void storeKernel(Registers *gpr, PagedMemory *dm, const MicroOp *op)
+{
+    dm->store((uint32_t)gpr[op->rs1].value + op->imm, FUNC3, gpr[op->rs2].value);
+}
+
+// Indexed by MicroOp::kernel: register ALU ops, immediate ALU ops (both in
+// AluOp order), LB LH LW LBU LHU, SB SH SW
+constexpr MicroFn microKernels[] = {
+    aluRegKernel<AluOp::AND>, aluRegKernel<AluOp::OR>, aluRegKernel<AluOp::ADD>, aluRegKernel<AluOp::SUB>,
+    aluRegKernel<AluOp::MUL>, aluRegKernel<AluOp::DIV>, aluRegKernel<AluOp::REM>, aluRegKernel<AluOp::XOR>,
+    aluRegKernel<AluOp::SLL>, aluRegKernel<AluOp::SRL>, aluRegKernel<AluOp::SRA>, aluRegKernel<AluOp::SLT>,
+    aluRegKernel<AluOp::SLTU>, aluRegKernel<AluOp::MULH>, aluRegKernel<AluOp::MULHSU>,
+    aluRegKernel<AluOp::MULHU>, aluRegKernel<AluOp::DIVU>, aluRegKernel<AluOp::REMU>,
+    aluImmKernel<AluOp::AND>, aluImmKernel<AluOp::OR>, aluImmKernel<AluOp::ADD>, aluImmKernel<AluOp::SUB>,
+    aluImmKernel<AluOp::MUL>, aluImmKernel<AluOp::DIV>, aluImmKernel<AluOp::REM>, aluImmKernel<AluOp::XOR>,
+    aluImmKernel<AluOp::SLL>, aluImmKernel<AluOp::SRL>, aluImmKernel<AluOp::SRA>, aluImmKernel<AluOp::SLT>,
+    aluImmKernel<AluOp::SLTU>, aluImmKernel<AluOp::MULH>, aluImmKernel<AluOp::MULHSU>,
+    aluImmKernel<AluOp::MULHU>, aluImmKernel<AluOp::DIVU>, aluImmKernel<AluOp::REMU>,
+    loadKernel<0b000>, loadKernel<0b001>, loadKernel<0b010>, loadKernel<0b100>, loadKernel<0b101>,
+    storeKernel<0b000>, storeKernel<0b001>, storeKernel<0b010>};
+constexpr int AluOpCount = (int)AluOp::REMU + 1;
+constexpr int LoadKernel = 2 * AluOpCount;
+constexpr int StoreKernel = LoadKernel + 5;
+constexpr int MicroKernelCount = sizeof(microKernels) / sizeof(microKernels[0]);
+
+// Superinstruction for two consecutive kernels, both inlined into one handler
+template <MicroFn A, MicroFn B>
+void fusedKernel(Registers *gpr, PagedMemory *dm, const MicroOp *op)
+{
+    A(gpr, dm, op);
+    B(gpr, dm, op + 1);
+}
+
+template <size_t... I>
+constexpr array<MicroFn, sizeof...(I)> makeFusedKernels(index_sequence<I...>)
+{
+    return {{fusedKernel<microKernels[I / MicroKernelCount], microKernels[I % MicroKernelCount]>...}};
+}
+
+constexpr array<MicroFn, MicroKernelCount * MicroKernelCount> fusedKernels =
+    makeFusedKernels(make_index_sequence<MicroKernelCount * MicroKernelCount>());
+
+// Straight-line run of instructions starting at startPc. The body is a list
+// of micro-ops, the terminating branch or jump (if any) is evaluated inline.
+struct TranslatedBlock
+{
+    enum Exit : uint8_t
+    {
+        FallThrough,
+        Branch,
+        Jump,         // JAL, or JALR when indirect is set
+        SystemCall    // ECALL
+    };
+
+    int startPc;
+    int length; // instructions, terminator included
+    vector<MicroOp> body;
+
+    Exit exit;
+    BranchCond cond;
+    uint8_t rd, rs1, rs2;
+    int imm;
+    bool indirect, link;
+    uint32_t linkAddress;
+    int takenPc, nextPc;
+
+    uint64_t executions = 0;
+};
+
+// Translates from startPc up to and including the next branch, jump or
+// ECALL, or to the end of the program
+TranslatedBlock translateBlock(const Program &program, int startPc)
+{
+    TranslatedBlock block;
+    block.startPc = startPc;
+    block.exit = TranslatedBlock::FallThrough;
+
+    const int size = (int)program.DecodedMemory.size();
+    int pc = startPc;
+    for (; pc < size; pc++)
+    {
+        const DecodedInst &d = program.DecodedMemory[pc];
+        if (d.Class == ExecClass::Branch || d.Class == ExecClass::Jump || d.Class == ExecClass::System)
+            break;
+
+        MicroOp op;
+        switch (d.Class)
+        {
+        case ExecClass::AluReg:
+            op.kernel = (uint8_t)d.ALUSel;
+            break;
+        case ExecClass::AluImm:
+            op.kernel = AluOpCount + (uint8_t)d.ALUSel;
+            break;
+        case ExecClass::Auipc:
+            op.kernel = AluOpCount + (uint8_t)AluOp::ADD; // the PC is known here
+            break;
+        case ExecClass::Load:
+            op.kernel = LoadKernel + (d.func3 < 0b100 ? d.func3 : d.func3 - 1);
+            break;
+        case ExecClass::Store:
+            op.kernel = StoreKernel + d.func3;
+            break;
+        default:
+            continue; // not executed by the pipeline either
+        }
+        op.run = microKernels[op.kernel];
+        op.length = 1;
+        op.rd = d.rd;
+        op.rs1 = d.rs1;
+        op.rs2 = d.rs2;
+        op.imm = d.Class == ExecClass::Auipc ? (int)(program.textAddress(pc) + d.imm) : d.imm;
+        block.body.push_back(op);
+    }
+
+    block.length = pc - startPc;
+    block.nextPc = pc;
+    if (pc < size)
+    {
+        const DecodedInst &d = program.DecodedMemory[pc];
+        block.length++;
+        block.nextPc = pc + 1;
+        block.cond = d.Cond;
+        block.rd = d.rd;
+        block.rs1 = d.rs1;
+        block.rs2 = d.rs2;
+        block.imm = d.imm;
+        block.indirect = d.CW.Indirect;
+        block.link = d.CW.RegWrite;
+        block.linkAddress = program.textAddress(pc + 1);
+        if (d.Class == ExecClass::Branch)
+        {
+            block.exit = TranslatedBlock::Branch;
+            block.takenPc = branchTarget(pc, d.imm);
+        }
+        else if (d.Class == ExecClass::Jump)
+        {
+            block.exit = TranslatedBlock::Jump;
+            block.takenPc = branchTarget(pc, d.imm);
+        }
+        else
+            block.exit = TranslatedBlock::SystemCall;
+    }
+
+    // Pair up neighbouring micro-ops into superinstructions
+    for (size_t i = 0; i + 1 < block.body.size(); i += 2)
+    {
+        block.body[i].run = fusedKernels[block.body[i].kernel * MicroKernelCount + block.body[i + 1].kernel];
+        block.body[i].length = 2;
+    }
+    return block;
+}
+
+// Anything a cache can miss to
+class MemoryLevel
+{
+public:
+    virtual ~MemoryLevel() {}
+
+    // Cycle at which the line holding addr arrives, for a request made at now
+    virtual uint64_t read(uint32_t addr, uint64_t now) = 0;
+
+    // Accepts a write of the line holding addr made at now: a dirty line
+    // evicted from above, or a store written through. Returns the cycle the
+    // write completes; an eviction does not wait for it.
+    virtual uint64_t write(uint32_t addr, uint64_t now) = 0;
+};
+
+struct CacheCounters
+{
+    uint64_t accesses = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t writebacks = 0; // dirty lines evicted
+    uint64_t writeThroughs = 0; // stores passed on to the next level
+
+    uint64_t prefetches = 0;        // lines filled by the prefetcher
+    uint64_t usefulPrefetches = 0;  // prefetched lines later hit by a demand access
+    uint64_t latePrefetches = 0;    // useful, but the fill was still on its way
+    uint64_t uselessPrefetches = 0; // prefetched lines evicted untouched
+};
+
+// Generates line addresses to fetch ahead of demand. It is trained on the
+// accesses that would otherwise stall: demand misses and first hits on
+// prefetched lines.
+class Prefetcher
+{
+public:
+    void configure(const CacheConfig &cfg)
+    {
+        kind = cfg.prefetcher;
+        degree = max(cfg.prefetchDegree, 1);
+        streams.assign(4, Stream());
+        strides.assign(64, StrideEntry());
+        clock = 0;
+    }
+
+    // Blocks worth prefetching after a trigger at block, made by the
+    // stream identified by key (the PC on the data side)
+    void candidates(int64_t block, int key, vector<int64_t> &out)
+    {
+        out.clear();
+        switch (kind)
+        {
+        case PrefetcherKind::NextLine:
+            for (int k = 1; k <= degree; k++)
+                out.push_back(block + k);
+            break;
+
+        case PrefetcherKind::Stream:
+        {
+            // Follow the stream whose last block is within a couple of lines,
+            // allocating the least recently used one otherwise
+            Stream *stream = nullptr;
+            for (Stream &s : streams)
+                if (s.valid && block != s.last && abs(block - s.last) <= 2)
+                    stream = &s;
+            if (stream)
+            {
+                int dir = block > stream->last ? 1 : -1;
+                stream->confidence = dir == stream->dir ? stream->confidence + 1 : 0;
+                stream->dir = dir;
+            }
+            else
+            {
+                stream = &*min_element(streams.begin(), streams.end(), [](const Stream &a, const Stream &b)
+                                       { return a.lastUse < b.lastUse; });
+                *stream = Stream();
+                stream->valid = true;
+            }
+            stream->last = block;
+            stream->lastUse = ++clock;
+            if (stream->confidence >= 1)
+                for (int k = 1; k <= degree; k++)
+                    out.push_back(block + stream->dir * k);
+            break;
+        }
+
+        case PrefetcherKind::Stride:
+        {
+            // Reference prediction table: a constant line stride per key
+            StrideEntry &entry = strides[(unsigned)key % strides.size()];
+            if (!entry.valid || entry.key != key)
+            {
+                entry = StrideEntry{key, block, 0, 0, true};
+                break;
+            }
+            int64_t stride = block - entry.last;
+            entry.confidence = stride == entry.stride ? min(entry.confidence + 1, 3) : 0;
+            entry.stride = stride;
+            entry.last = block;
+            if (entry.confidence >= 1 && stride != 0)
+                for (int k = 1; k <= degree; k++)
+                    out.push_back(block + stride * k);
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+private:
+    struct Stream
+    {
+        int64_t last = 0;
+        int dir = 1;
+        int confidence = 0;
+        uint64_t lastUse = 0;
+        bool valid = false;
+    };
+
+    struct StrideEntry
+    {
+        int key = 0;
+        int64_t last = 0;
+        int64_t stride = 0;
+        int confidence = 0;
+        bool valid = false;
+    };
+
+    PrefetcherKind kind = PrefetcherKind::None;
+    int degree = 1;
+    vector<Stream> streams;
+    vector<StrideEntry> strides;
+    uint64_t clock = 0;
+};
+
+// Tag model of a set-associative cache. It only decides hits, misses and
+// their latency; the data itself stays in the backing memory.
+class Cache
+{
+public:
+    // trainPerPc keys the stride prefetcher by the accessing PC; the fetch
+    // side trains a single stream instead
+    void configure(const CacheConfig &cfg, bool trainPerPc = true)
+    {
+        config = cfg;
+        perPc = trainPerPc;
+        sets = 0;
+        lines.clear();
+        total = CacheCounters();
+        pcCounters.clear();
+        regionCounters.clear();
+        if (!enabled())
+            return;
+
+        check(cfg);
+        sets = cfg.sizeBytes / ((size_t)cfg.ways * cfg.lineBytes);
+        lines.assign(sets * cfg.ways, Line());
+        plruBits.assign(sets, 0);
+        clock = 0;
+        seed = 2463534242u;
+        prefetcher.configure(cfg);
+    }
+
+    // Throws invalid_argument for a geometry the cache cannot be built with
+    static void check(const CacheConfig &cfg)
+    {
+        if (cfg.sizeBytes == 0)
+            return;
+        if (cfg.ways <= 0 || cfg.lineBytes <= 0 || cfg.sizeBytes % ((size_t)cfg.ways * cfg.lineBytes) != 0)
+            throw invalid_argument("cache size must be a multiple of ways * line size");
+        if (cfg.replacement == Replacement::PLRU && (cfg.ways & (cfg.ways - 1)) != 0)
+            throw invalid_argument("PLRU needs a power-of-two number of ways");
+        if (cfg.regionBytes == 0)
+            throw invalid_argument("cache region size must be at least 1 byte");
+    }
+
+    bool enabled() const { return config.sizeBytes != 0; }
+
+    // Sends misses and dirty evictions to level instead of charging the
+    // flat miss latency; nullptr detaches
+    void attach(MemoryLevel *level) { below = level; }
+
+    // Looks up a byte address made by the instruction at pc in cycle now,
+    // updating the tags, replacement state, prefetcher and counters.
+    // Returns the extra cycles.
+    int access(uint32_t addr, bool write, int pc, uint64_t now)
+    {
+        uint32_t block = addr / config.lineBytes;
+        CacheCounters delta;
+        delta.accesses = 1;
+        int latency = config.hitLatency;
+        bool trigger = false;
+
+        Line *line = find(block);
+        if (line)
+        {
+            delta.hits = 1;
+            if (line->prefetched)
+            {
+                // First demand use of a prefetched line; pay what is left of its fill
+                line->prefetched = false;
+                delta.usefulPrefetches = 1;
+                if (line->readyAt > now)
+                {
+                    delta.latePrefetches = 1;
+                    latency = max<int>(latency, line->readyAt - now);
+                }
+                trigger = true;
+            }
+            line->dirty |= write && config.writeBack;
+            touch(block % sets, line - &lines[block % sets * config.ways]);
+        }
+        else
+        {
+            delta.misses = 1;
+            trigger = true;
+            if (!write || config.writeAllocate)
+            {
+                latency = missCycles(block, now);
+                line = fill(block, now, now + latency, delta);
+                line->dirty = write && config.writeBack;
+            }
+            else if (below && config.writeBack)
+                below->write(addr, now); // a store that does not allocate goes straight to memory
+        }
+
+        // Write-through: every store continues to the next level, or to
+        // memory at the miss latency, and waits for it
+        if (write && !config.writeBack)
+        {
+            delta.writeThroughs = 1;
+            latency = below ? (int)(below->write(addr, now + latency) - now) : latency + config.missLatency;
+        }
+
+        if (trigger && config.prefetcher != PrefetcherKind::None)
+        {
+            prefetcher.candidates(block, perPc ? pc : 0, pending);
+            for (int64_t target : pending)
+                if (target >= 0 && target <= UINT32_MAX / config.lineBytes && !find((uint32_t)target))
+                {
+                    uint64_t readyAt = now + missCycles((uint32_t)target, now);
+                    fill((uint32_t)target, now, readyAt, delta)->prefetched = true;
+                    delta.prefetches++;
+                }
+        }
+
+        add(total, delta);
+        if (config.profile)
+        {
+            add(pcCounters[pc], delta);
+            add(regionCounters[addr / config.regionBytes * config.regionBytes], delta);
+        }
+        return latency;
+    }
+
+    const CacheConfig &settings() const { return config; }
+    const CacheCounters &counters() const { return total; }
+    // Empty unless settings().profile is set
+    const map<int, CacheCounters> &byPc() const { return pcCounters; }
+    const map<uint32_t, CacheCounters> &byRegion() const { return regionCounters; } // keyed by region base
+
+private:
+    struct Line
+    {
+        uint32_t tag = 0;
+        uint64_t lastUse = 0;
+        uint64_t readyAt = 0; // cycle the fill completes
+        bool valid = false;
+        bool dirty = false;
+        bool prefetched = false; // filled by the prefetcher and not used yet
+    };
+
+    static void add(CacheCounters &to, const CacheCounters &delta)
+    {
+        to.accesses += delta.accesses;
+        to.hits += delta.hits;
+        to.misses += delta.misses;
+        to.evictions += delta.evictions;
+        to.writebacks += delta.writebacks;
+        to.writeThroughs += delta.writeThroughs;
+        to.prefetches += delta.prefetches;
+        to.usefulPrefetches += delta.usefulPrefetches;
+        to.latePrefetches += delta.latePrefetches;
+        to.uselessPrefetches += delta.uselessPrefetches;
+    }
+
+    Line *find(uint32_t block)
+    {
+        Line *ways = &lines[block % sets * config.ways];
+        uint32_t tag = block / sets;
+        for (int way = 0; way < config.ways; way++)
+            if (ways[way].valid && ways[way].tag == tag)
+                return &ways[way];
+        return nullptr;
+    }
+
+    int missCycles(uint32_t block, uint64_t now)
+    {
+        if (!below)
+            return config.missLatency;
+        return (int)(below->read(block * config.lineBytes, now + config.hitLatency) - now);
+    }
+
+    // Installs block in its set at now, evicting a victim if needed
+    Line *fill(uint32_t block, uint64_t now, uint64_t readyAt, CacheCounters &delta)
+    {
+        size_t set = block % sets;
+        int way = victim(set);
+        Line &line = lines[set * config.ways + way];
+        if (line.valid)
+        {
+            delta.evictions++;
+            delta.writebacks += line.dirty;
+            delta.uselessPrefetches += line.prefetched;
+            if (line.dirty && below)
+                below->write((uint32_t)((line.tag * sets + set) * config.lineBytes), now);
+        }
+        line = Line();
+        line.valid = true;
+        line.tag = block / sets;
+        line.readyAt = readyAt;
+        touch(set, way);
+        return &line;
+    }
+
+    void touch(size_t set, int way)
+    {
+        lines[set * config.ways + way].lastUse = ++clock;
+
+        // Point every tree node on the path away from the used way
+        uint64_t &bits = plruBits[set];
+        int node = 1;
+        for (int half = config.ways / 2; half > 0; half /= 2)
+        {
+            bool right = way & half;
+            bits = right ? bits & ~(1ull << node) : bits | (1ull << node);
+            node = node * 2 + right;
+        }
+    }
+
+    int victim(size_t set)
+    {
+        const Line *ways = &lines[set * config.ways];
+        for (int way = 0; way < config.ways; way++)
+            if (!ways[way].valid)
+                return way;
+
+        switch (config.replacement)
+        {
+        case Replacement::PLRU:
+        {
+            int node = 1, way = 0;
+            for (int half = config.ways / 2; half > 0; half /= 2)
+            {
+                bool right = plruBits[set] >> node & 1;
+                way += right ? half : 0;
+                node = node * 2 + right;
+            }
+            return way;
+        }
+        case Replacement::Random:
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return seed % config.ways;
+        default:
+            return min_element(ways, ways + config.ways, [](const Line &a, const Line &b)
+                               { return a.lastUse < b.lastUse; }) -
+                   ways;
+        }
+    }
+
+    CacheConfig config;
+    MemoryLevel *below = nullptr;
+    bool perPc = true;
+    size_t sets = 0;
+    vector<Line> lines;        // sets * ways, set-major
+    vector<uint64_t> plruBits; // one tree per set, node n at bit n
+    uint64_t clock = 0;
+    uint32_t seed = 0;
+
+    Prefetcher prefetcher;
+    vector<int64_t> pending; // candidates of the current access
+
+    CacheCounters total;
+    map<int, CacheCounters> pcCounters;
+    map<uint32_t, CacheCounters> regionCounters;
+};
+
+struct DramCounters
+{
+    uint64_t reads = 0;
+    uint64_t writes = 0;
+    uint64_t rowHits = 0;      // the row was already open
+    uint64_t rowEmpty = 0;     // the bank was precharged
+    uint64_t rowConflicts = 0; // another row had to be closed first
+    uint64_t readCycles = 0;   // request to data, summed over reads
+};
+
+// Banked DRAM with one row buffer per bank and a shared data bus. Lines are
+// interleaved across banks row by row.
+class Dram : public MemoryLevel
+{
+public:
+    void configure(const DramConfig &cfg)
+    {
+        if (cfg.banks <= 0 || cfg.rowBytes == 0)
+            throw invalid_argument("DRAM needs at least one bank and a row size");
+        config = cfg;
+        bankState.assign(cfg.banks, Bank());
+        busFree = 0;
+        stats = DramCounters();
+    }
+
+    uint64_t read(uint32_t addr, uint64_t now) override
+    {
+        uint64_t done = access(addr, now);
+        stats.reads++;
+        stats.readCycles += done - now;
+        return done;
+    }
+
+    uint64_t write(uint32_t addr, uint64_t now) override
+    {
+        stats.writes++;
+        return access(addr, now);
+    }
+
+    const DramCounters &counters() const { return stats; }
+
+private:
+    struct Bank
+    {
+        uint32_t row = 0;
+        bool open = false;
+        uint64_t readyAt = 0; // next cycle it accepts a command
+    };
+
+    uint64_t access(uint32_t addr, uint64_t now)
+    {
+        uint32_t rowIndex = addr / config.rowBytes;
+        Bank &bank = bankState[rowIndex % config.banks];
+        uint32_t row = rowIndex / config.banks;
+
+        uint64_t start = max(now, bank.readyAt);
+        int latency = config.tRCD + config.tCAS;
+        if (bank.open && bank.row == row)
+        {
+            latency = config.tCAS;
+            stats.rowHits++;
+        }
+        else if (bank.open)
+        {
+            latency += config.tRP;
+            stats.rowConflicts++;
+        }
+        else
+            stats.rowEmpty++;
+
+        uint64_t done = max(start + latency, busFree) + config.tBurst;
+        busFree = done;
+        bank.row = row;
+        bank.open = config.openPage;
+        bank.readyAt = config.openPage ? done : done + config.tRP;
+        return done;
+    }
+
+    DramConfig config;
+    vector<Bank> bankState;
+    uint64_t busFree = 0;
+    DramCounters stats;
+};
+
+struct MshrCounters
+{
+    uint64_t misses = 0;      // requests from the L1 caches
+    uint64_t merged = 0;      // joined a request already in flight for the line
+    uint64_t fullCycles = 0;  // cycles requests waited for a free MSHR
+    uint64_t peak = 0;        // most requests in flight at once
+};
+
+// Memory system below the L1 caches: a shared L2 and/or DRAM, reached
+// through a limited set of miss status holding registers. Each miss becomes
+// a completion event; the MSHR is released when the event fires, and the
+// requesting stage counts down to that cycle, so the pipeline is not woken
+// before the data returns.
+class MemoryBackend : public MemoryLevel
+{
+public:
+    void configure(const MemoryConfig &cfg)
+    {
+        config = cfg;
+        l2.configure(cfg.l2);
+        if (cfg.dram)
+            dram.configure(cfg.dramTiming);
+        l2.attach(cfg.dram ? &dram : nullptr);
+        events = decltype(events)();
+        inFlight.clear();
+        stats = MshrCounters();
+    }
+
+    bool active() const { return l2.enabled() || config.dram; }
+
+    uint64_t read(uint32_t addr, uint64_t now) override
+    {
+        retire(now);
+        stats.misses++;
+
+        uint32_t line = addr / lineBytes();
+        auto pending = inFlight.find(line);
+        if (pending != inFlight.end())
+        {
+            stats.merged++;
+            return pending->second;
+        }
+
+        // All MSHRs busy: the request starts when the oldest one returns
+        uint64_t start = now;
+        while ((int)inFlight.size() >= max(config.mshrs, 1))
+        {
+            start = max(start, events.top().cycle);
+            retire(start);
+        }
+        stats.fullCycles += start - now;
+
+        uint64_t done = l2.enabled() ? start + l2.access(addr, false, -1, start) : dram.read(addr, start);
+        inFlight[line] = done;
+        events.push(Event{done, line});
+        stats.peak = max<uint64_t>(stats.peak, inFlight.size());
+        return done;
+    }
+
+    uint64_t write(uint32_t addr, uint64_t now) override
+    {
+        retire(now);
+        if (l2.enabled())
+            return now + l2.access(addr, true, -1, now);
+        return dram.write(addr, now);
+    }
+
+    const Cache &secondLevel() const { return l2; }
+    const Dram *memory() const { return config.dram ? &dram : nullptr; }
+    const MshrCounters &counters() const { return stats; }
+
+private:
+    struct Event
+    {
+        uint64_t cycle;
+        uint32_t line;
+        bool operator>(const Event &other) const { return cycle > other.cycle; }
+    };
+
+    // Granularity at which requests merge: L2 lines, or the L1 line
+    // addresses themselves when DRAM is reached directly
+    uint32_t lineBytes() const { return l2.enabled() ? config.l2.lineBytes : 1; }
+
+    // Fires the completion events up to now, releasing their MSHRs
+    void retire(uint64_t now)
+    {
+        while (!events.empty() && events.top().cycle <= now)
+        {
+            auto entry = inFlight.find(events.top().line);
+            if (entry != inFlight.end() && entry->second == events.top().cycle)
+                inFlight.erase(entry);
+            events.pop();
+        }
+    }
+
+    MemoryConfig config;
+    Cache l2;
+    Dram dram;
+    priority_queue<Event, vector<Event>, greater<Event>> events;
+    unordered_map<uint32_t, uint64_t> inFlight; // line -> cycle its data returns
+    MshrCounters stats;
+};
+
+// Branch prediction for the fetch stage. The BTB recognises control
+// transfers by PC and supplies their targets, the return stack supplies
+// return addresses, and the direction predictor decides conditional
+// branches. History and return stack are updated speculatively at fetch and
+// restored from the Prediction of a branch that EX finds mispredicted.
+class BranchPredictor
+{
+public:
+    struct Accuracy
+    {
+        uint64_t executions = 0;
+        uint64_t taken = 0;
+        uint64_t mispredictions = 0;
+    };
+
+    // Throws invalid_argument for a BTB the predictor cannot index
+    static void check(const CoreConfig &config)
+    {
+        if (config.btbEntries < 1 || (config.btbEntries & (config.btbEntries - 1)) != 0)
+            throw invalid_argument("BTB entries must be a power of two");
+    }
+
+    void configure(const CoreConfig &config)
+    {
+        check(config);
+        kind = config.predictor;
+        tableMask = (1u << config.predictorBits) - 1;
+        historyMask = (1u << config.historyBits) - 1;
+        bimodal.assign(tableMask + 1, 1);
+        gshare.assign(tableMask + 1, 1);
+        chooser.assign(tableMask + 1, 2);
+        btb.assign(config.btbEntries, BtbEntry());
+        ras.assign(max(config.rasDepth, 1), 0);
+        history = 0;
+        rasTop = 0;
+        branches.clear();
+    }
+
+    Prediction predict(int pc)
+    {
+        Prediction pred{pc + 1, history, rasTop, ras[rasTop]};
+        if (kind == PredictorKind::None)
+            return pred;
+
+        const BtbEntry &entry = btb[pc & (btb.size() - 1)];
+        if (!entry.valid || entry.pc != pc)
+            return pred;
+
+        switch (entry.type)
+        {
+        case Branch:
+        {
+            bool taken = direction(pc, entry.target);
+            history = ((history << 1) | taken) & historyMask;
+            if (taken)
+                pred.NextPc = entry.target;
+            break;
+        }
+        case Call:
+            push(pc + 1);
+            pred.NextPc = entry.target;
+            break;
+        case Return:
+            pred.NextPc = pop();
+            break;
+        case Jump:
+            pred.NextPc = entry.target;
+            break;
+        }
+        return pred;
+    }
+
+    // Trains on a branch or jump leaving EX and returns whether fetch went
+    // the wrong way after it
+    bool resolve(int pc, const DecodedInst &inst, const Prediction &pred, bool taken, int target)
+    {
+        Type type = classify(inst);
+        int next = taken ? target : pc + 1;
+        bool mispredicted = next != pred.NextPc;
+
+        if (type == Branch)
+        {
+            bool bimodalRight = counterTaken(bimodal[pc & tableMask]) == taken;
+            bool gshareRight = counterTaken(gshare[(pc ^ pred.History) & tableMask]) == taken;
+            if (bimodalRight != gshareRight)
+                train(chooser[pc & tableMask], gshareRight);
+            train(bimodal[pc & tableMask], taken);
+            train(gshare[(pc ^ pred.History) & tableMask], taken);
+        }
+
+        if (taken)
+        {
+            BtbEntry &entry = btb[pc & (btb.size() - 1)];
+            entry = BtbEntry{pc, target, type, true};
+        }
+
+        if (mispredicted && kind != PredictorKind::None)
+        {
+            history = type == Branch ? ((pred.History << 1) | taken) & historyMask : pred.History;
+            rasTop = pred.RasTop;
+            ras[rasTop] = pred.RasValue;
+            if (type == Call)
+                push(pc + 1);
+            else if (type == Return)
+                pop();
+        }
+
+        Accuracy &acc = branches[pc];
+        acc.executions++;
+        acc.taken += taken;
+        acc.mispredictions += mispredicted;
+        return mispredicted;
+    }
+
+    const map<int, Accuracy> &profile() const { return branches; }
+
+private:
+    enum Type : uint8_t
+    {
+        Branch,
+        Jump,
+        Call,  // jump that links to x1 or x5
+        Return // JALR through x1 or x5 that does not link
+    };
+
+    struct BtbEntry
+    {
+        int pc = 0;
+        int target = 0;
+        Type type = Branch;
+        bool valid = false;
+    };
+
+    static Type classify(const DecodedInst &inst)
+    {
+        bool link = inst.rd == 1 || inst.rd == 5;
+        if (inst.CW.Branch)
+            return Branch;
+        if (inst.opcode == 0b1100111 && !link && (inst.rs1 == 1 || inst.rs1 == 5))
+            return Return;
+        return link ? Call : Jump;
+    }
+
+    static bool counterTaken(uint8_t counter) { return counter >= 2; }
+
+    static void train(uint8_t &counter, bool up)
+    {
+        if (up && counter < 3)
+            counter++;
+        else if (!up && counter > 0)
+            counter--;
+    }
+
+    bool direction(int pc, int target) const
+    {
+        switch (kind)
+        {
+        case PredictorKind::Static:
+            return target <= pc;
+        case PredictorKind::Bimodal:
+            return counterTaken(bimodal[pc & tableMask]);
+        case PredictorKind::Gshare:
+            return counterTaken(gshare[(pc ^ history) & tableMask]);
+        case PredictorKind::Tournament:
+            return counterTaken(counterTaken(chooser[pc & tableMask]) ? gshare[(pc ^ history) & tableMask]
+                                                                       : bimodal[pc & tableMask]);
+        default:
+            return false;
+        }
+    }
+
+    void push(int value)
+    {
+        rasTop = (rasTop + 1) % ras.size();
+        ras[rasTop] = value;
+    }
+
+    int pop()
+    {
+        int value = ras[rasTop];
+        rasTop = (rasTop + ras.size() - 1) % ras.size();
+        return value;
+    }
+
+    PredictorKind kind = PredictorKind::None;
+    uint32_t tableMask = 0, historyMask = 0;
+    vector<uint8_t> bimodal, gshare, chooser; // 2-bit saturating counters
+    vector<BtbEntry> btb;
+    vector<int> ras; // circular, so overflow drops the oldest entry
+    uint32_t history = 0;
+    uint16_t rasTop = 0;
+    map<int, Accuracy> branches;
+};
+
+// Writes value in LEB128 form, at most 10 bytes; returns the end
+uint8_t *putVarint(uint8_t *out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+uint64_t getVarint(const uint8_t *&p, const uint8_t *end)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+            throw runtime_error("truncated trace record");
+        uint8_t byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    throw runtime_error("malformed trace varint");
+}
+
+uint64_t zigzag(int64_t value) { return (uint64_t)value << 1 ^ (uint64_t)(value >> 63); }
+int64_t unzigzag(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+
+// Binary pipeline trace. The simulating thread encodes one record per cycle,
+// or per span of skipped cycles, into a single-producer single-consumer ring
+// buffer, and a writer thread drains the ring into the file; the core only
+// waits when the ring is full. The file starts with Magic, then records:
+//
+//   byte   stages: bit s set if stage s (IF, ID, EX, MEM, WB) holds an
+//          instruction; 0x20 writes follow, 0x40 span follows, 0x80 gap follows
+//   byte   events: StallCause in bits 0-2; 0x08 MEM waiting, 0x10 redirect,
+//          0x20 unit busy, 0x40 fetch waiting for a miss
+//   varint cycles since the end of the previous record (if 0x80)
+//   varint span - 1 (if 0x40)
+//   varint per occupied stage: zigzag PC delta from that stage's last PC
+//   varint write count, then per write (if 0x20): a kind byte, 0 for a
+//          register (rd byte, value varint) or 1 + func3 for a store
+//          (zigzag address delta from the last store, value varint)
+class TraceWriter
+{
+public:
+    static constexpr char Magic[8] = {'R', 'V', 'T', 'R', 'A', 'C', 'E', '1'};
+
+    explicit TraceWriter(const string &path, size_t ringBytes = 1 << 20)
+        : out(path, ios::binary), ring(ringBytes)
+    {
+        if (!out)
+            throw runtime_error("cannot open " + path);
+        if (ringBytes & (ringBytes - 1))
+            throw invalid_argument("trace ring size must be a power of two");
+        out.write(Magic, sizeof(Magic));
+        writes.reserve(256);
+        writer = thread([this]()
+                        { drain(); });
+    }
+
+    ~TraceWriter() { close(); }
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+
+    // Writes made in the cycle of the next record
+    void registerWrite(int rd, int value)
+    {
+        uint8_t *w = reserveWrite();
+        *w++ = 0;
+        *w++ = (uint8_t)rd;
+        writes.resize(putVarint(w, (uint32_t)value) - writes.data());
+    }
+
+    void memoryWrite(uint32_t addr, int func3, int value)
+    {
+        uint8_t *w = reserveWrite();
+        *w++ = (uint8_t)(1 + func3);
+        w = putVarint(w, zigzag((int32_t)(addr - lastAddress)));
+        writes.resize(putVarint(w, (uint32_t)value) - writes.data());
+        lastAddress = addr;
+    }
+
+    // Records span cycles from first with the given stage PCs (-1 for an
+    // empty stage) and events, together with the writes collected so far
+    void cycles(uint64_t first, uint64_t span, const int (&pcs)[5], uint8_t events)
+    {
+        uint8_t record[96];
+        uint8_t stages = 0;
+        for (int s = 0; s < 5; s++)
+            stages |= (pcs[s] >= 0) << s;
+        stages |= (writeCount > 0) << 5 | (span > 1) << 6 | (first != nextCycle) << 7;
+        uint8_t *w = record;
+        *w++ = stages;
+        *w++ = events;
+        if (first != nextCycle)
+            w = putVarint(w, first - nextCycle);
+        if (span > 1)
+            w = putVarint(w, span - 1);
+        for (int s = 0; s < 5; s++)
+            if (pcs[s] >= 0)
+            {
+                w = putVarint(w, zigzag((int64_t)pcs[s] - lastPc[s]));
+                lastPc[s] = pcs[s];
+            }
+        nextCycle = first + span;
+        if (writeCount > 0)
+            w = putVarint(w, writeCount);
+        push(record, w - record, writes.data(), writes.size());
+        writes.clear();
+        writeCount = 0;
+    }
+
+    // Drains the ring and closes the file; the destructor does it too
+    void close()
+    {
+        if (!writer.joinable())
+            return;
+        closing.store(true, memory_order_release);
+        writer.join();
+        out.close();
+    }
+
+private:
+    ofstream out;
+    vector<uint8_t> ring;
+    alignas(64) atomic<size_t> head{0}; // bytes produced
+    alignas(64) atomic<size_t> tail{0}; // bytes written to the file
+    atomic<bool> closing{false};
+    thread writer;
+
+    // Producer side
+    size_t freeTail = 0; // a value of tail seen earlier, so at most the real one
+    vector<uint8_t> writes;
+    uint32_t writeCount = 0;
+    int lastPc[5] = {};
+    uint32_t lastAddress = 0;
+    uint64_t nextCycle = 0;
+
+    // Room for one more write of at most 16 bytes at the end of writes
+    uint8_t *reserveWrite()
+    {
+        size_t size = writes.size();
+        writes.resize(size + 16);
+        writeCount++;
+        return writes.data() + size;
+    }
+
+    // Appends a record given in two pieces and publishes it
+    void push(const uint8_t *data, size_t n, const uint8_t *more, size_t moreBytes)
+    {
+        size_t h = head.load(memory_order_relaxed);
+        copyIn(h, data, n);
+        copyIn(h + n, more, moreBytes);
+        head.store(h + n + moreBytes, memory_order_release);
+    }
+
+    void copyIn(size_t h, const uint8_t *data, size_t n)
+    {
+        if (n == 0)
+            return;
+        while (h + n - freeTail > ring.size())
+        {
+            freeTail = tail.load(memory_order_acquire);
+            if (h + n - freeTail > ring.size())
+                this_thread::yield();
+        }
+        size_t at = h & (ring.size() - 1), first = min(n, ring.size() - at);
+        memcpy(&ring[at], data, first);
+        memcpy(&ring[0], data + first, n - first);
+    }
+
+    void drain()
+    {
+        size_t t = tail.load(memory_order_relaxed);
+        for (;;)
+        {
+            size_t h = head.load(memory_order_acquire);
+            if (h == t)
+            {
+                if (closing.load(memory_order_acquire) && head.load(memory_order_acquire) == t)
+                    break;
+                this_thread::sleep_for(chrono::microseconds(100));
+                continue;
+            }
+            size_t at = t & (ring.size() - 1), n = min(h - t, ring.size() - at);
+            out.write((const char *)&ring[at], n);
+            t += n;
+            tail.store(t, memory_order_release);
+        }
+        out.flush();
+    }
+};
+
+// Calling-context tree of the pipeline's cycle profile. Each node is a
+// function entry reached through a chain of calls; retired calls and returns
+// move the current node, and cycles are charged to whichever node is current.
+// Calls and returns are told apart from the link-register usage of JAL and
+// JALR, as the return address stack does.
+class CallProfile
+{
+public:
+    struct Context
+    {
+        int parent; // -1 for the root
+        int function; // instruction index of the entry
+        int depth;
+        uint64_t cycles;
+    };
+
+    // Recursion deeper than this is charged to the deepest frame
+    static constexpr int MaxDepth = 256;
+
+    void reset(int entry)
+    {
+        contexts.assign(1, Context{-1, entry, 0, 0});
+        children.clear();
+        current = 0;
+        overflow = 0;
+        callPending = false;
+    }
+
+    // Follows a retired jump. The callee is only known once the instruction
+    // after the call is charged, which enters it.
+    void retire(const DecodedInst &inst)
+    {
+        bool link = inst.rd == 1 || inst.rd == 5;
+        if (inst.CW.Indirect && !link && (inst.rs1 == 1 || inst.rs1 == 5))
+        {
+            if (overflow > 0)
+                overflow--;
+            else if (contexts[current].parent >= 0)
+                current = contexts[current].parent;
+        }
+        callPending = link;
+    }
+
+    void charge(int pc, uint64_t cycles)
+    {
+        if (callPending)
+            enter(pc);
+        contexts[current].cycles += cycles;
+    }
+
+    const vector<Context> &nodes() const { return contexts; }
+
+private:
+    vector<Context> contexts;
+    unordered_map<uint64_t, int> children; // (parent, function) -> node
+    int current = 0;
+    int overflow = 0;
+    bool callPending = false;
+
+    void enter(int function)
+    {
+        callPending = false;
+        if (contexts[current].depth == MaxDepth)
+        {
+            overflow++;
+            return;
+        }
+        uint64_t key = (uint64_t)current << 32 | (uint32_t)function;
+        auto child = children.find(key);
+        if (child == children.end())
+        {
+            contexts.push_back(Context{current, function, contexts[current].depth + 1, 0});
+            child = children.emplace(key, (int)contexts.size() - 1).first;
+        }
+        current = child->second;
+    }
+};
+
+// Multiply or divide in flight in its unit. The result is written to the
+// register file once it is ready and the instruction has passed WB, so it
+// never lands before the writes of older instructions.
+struct UnitOperation
+{
+    uint32_t tag;
+    uint64_t readyAt; // cycle whose first half writes the result
+    int value;
+    uint8_t rd;
+    bool write;
+    bool retired;
+};
+
+// Fixed part of a snapshot file written by Core::checkpoint(). It is followed
+// by both latch buffers, the registers, the stats, the unit operations, the
+// retired count of each PC and the address of each memory page; then, from
+// the next 4 KiB boundary on, the pages themselves, so that a restore can
+// map them straight from the file.
+struct SnapshotHeader
+{
+    static constexpr char Magic[8] = {'R', 'V', 'S', 'N', 'A', 'P', '0', '1'};
+
+    char magic[8];
+    uint64_t program; // programFingerprint() of the program it was taken of
+    uint32_t latchBytes, statsBytes, unitOpBytes; // layout of this build
+    uint32_t unitOps, retiredPcs, pages;
+
+    uint64_t functionalRetired;
+    uint64_t unitFree[2];
+    uint32_t pendingUnit, unitWrites, nextTag;
+    int32_t exitStatus;
+    uint8_t curBuffer; // which latch buffer is current
+    uint8_t fetchEnabled, halted;
+};
+
+// One simulated five-stage pipeline with its own registers, data memory and
+// latches. Cores share nothing but the read-only Program, so a process can
+// host as many of them as it likes.
+class Core
+{
+public:
+    vector<Registers> GPR;
+    PagedMemory DM;
+
+    // Receives the per-write trace lines; nullptr disables them
+    ostream *log = &cout;
+
+    // Receives what the program writes to stdout and stderr; nullptr drops it
+    ostream *console = &cout;
+
+    // Receives a binary record of every cycle while set; may be switched
+    // between calls to run()
+    TraceWriter *trace = nullptr;
+
+    CoreConfig config;
+    PipelineStats stats;
+
+    explicit Core(shared_ptr<const Program> prog, const CoreConfig &cfg = CoreConfig())
+        : config(cfg), program(move(prog))
+    {
+        reset();
+    }
+
+    // Switches the core to another program and resets it, keeping the
+    // allocations of the previous run
+    void load(shared_ptr<const Program> prog)
+    {
+        program = move(prog);
+        blockCache.clear();
+        reset();
+    }
+
+    // Latches point into this object, so a core stays where it was built
+    Core(const Core &) = delete;
+    Core &operator=(const Core &) = delete;
+
+    void reset()
+    {
+        GPR.assign(32, Registers());
+        DM.clear();
+        for (const Segment &segment : program->Segments)
+            DM.map(segment.vaddr, segment.data, segment.fileSize, segment.memSize);
+        latchBuffers[0] = latchBuffers[1] = PipelineLatches();
+        cur = &latchBuffers[0];
+        nxt = &latchBuffers[1];
+        cur->pc = PC(program->Entry, true);
+        stats = PipelineStats();
+        predictor.configure(config);
+        icache.configure(config.icache, false);
+        dcache.configure(config.dcache);
+        backend.configure(config.memory);
+        icache.attach(backend.active() ? &backend : nullptr);
+        dcache.attach(backend.active() ? &backend : nullptr);
+        nextTag = 1;
+        fetchEnabled = true;
+        unitOps.clear();
+        unitFree[0] = unitFree[1] = 0;
+        pendingUnit = unitWrites = 0;
+        halted = false;
+        exitStatus = 0;
+        functionalRetired = 0;
+        retiredCounts.assign(program->DecodedMemory.size(), 0);
+        cycleCounts.assign(config.profileCycles ? program->DecodedMemory.size() : 0, 0);
+        calls.reset(program->Entry);
+        lastRetired = program->Entry;
+        snapshotImage = nullptr;
+    }
+
+    // Writes the architectural and pipeline state to a snapshot file: both
+    // latch buffers, the registers with their scoreboard counts, data memory,
+    // the counters and the multiplies and divides in flight. Caches, the
+    // predictor and the profiles are left out and start cold on restore.
+    void checkpoint(const string &path) const
+    {
+        ofstream out(path, ios::binary);
+        if (!out)
+            throw runtime_error("cannot open " + path);
+
+        vector<uint32_t> pages;
+        DM.forEachPage([&](uint32_t addr, const uint8_t *)
+                       { pages.push_back(addr); });
+
+        SnapshotHeader header = {};
+        memcpy(header.magic, SnapshotHeader::Magic, sizeof(header.magic));
+        header.program = programFingerprint(*program);
+        header.latchBytes = sizeof(PipelineLatches);
+        header.statsBytes = sizeof(PipelineStats);
+        header.unitOpBytes = sizeof(UnitOperation);
+        header.unitOps = unitOps.size();
+        header.retiredPcs = retiredCounts.size();
+        header.pages = pages.size();
+        header.functionalRetired = functionalRetired;
+        header.unitFree[0] = unitFree[0];
+        header.unitFree[1] = unitFree[1];
+        header.pendingUnit = pendingUnit;
+        header.unitWrites = unitWrites;
+        header.nextTag = nextTag;
+        header.exitStatus = exitStatus;
+        header.curBuffer = cur == &latchBuffers[1];
+        header.fetchEnabled = fetchEnabled;
+        header.halted = halted;
+
+        size_t offset = 0;
+        auto put = [&](const void *data, size_t bytes)
+        {
+            out.write((const char *)data, bytes);
+            offset += bytes;
+        };
+        put(&header, sizeof(header));
+        put(latchBuffers, sizeof(latchBuffers));
+        put(GPR.data(), GPR.size() * sizeof(Registers));
+        put(&stats, sizeof(stats));
+        put(unitOps.data(), unitOps.size() * sizeof(UnitOperation));
+        put(retiredCounts.data(), retiredCounts.size() * sizeof(uint64_t));
+        put(pages.data(), pages.size() * sizeof(uint32_t));
+        static const uint8_t padding[PagedMemory::PageSize] = {};
+        put(padding, -offset & (PagedMemory::PageSize - 1));
+        DM.forEachPage([&](uint32_t, const uint8_t *data)
+                       { put(data, PagedMemory::PageSize); });
+        if (!out.flush())
+            throw runtime_error("cannot write " + path);
+    }
+
+    // Restores a snapshot that checkpoint() wrote of a core running the same
+    // program. The memory pages are mapped from the file rather than read,
+    // and only copied when first written.
+    void restore(const string &path)
+    {
+        auto file = make_shared<const MappedFile>(path);
+        const uint8_t *p = file->data();
+        SnapshotHeader header;
+        if (file->size() < sizeof(header))
+            throw runtime_error(path + ": truncated snapshot");
+        memcpy(&header, p, sizeof(header));
+        if (memcmp(header.magic, SnapshotHeader::Magic, sizeof(header.magic)) != 0)
+            throw runtime_error(path + ": not a snapshot");
+        if (header.latchBytes != sizeof(PipelineLatches) || header.statsBytes != sizeof(PipelineStats) ||
+            header.unitOpBytes != sizeof(UnitOperation))
+            throw runtime_error(path + ": snapshot written by an incompatible build");
+        if (header.program != programFingerprint(*program) || header.retiredPcs != program->DecodedMemory.size())
+            throw runtime_error(path + ": snapshot of a different program");
+
+        uint64_t fixed = sizeof(header) + sizeof(latchBuffers) + 32 * sizeof(Registers) + sizeof(PipelineStats) +
+                         (uint64_t)header.unitOps * sizeof(UnitOperation) + (uint64_t)header.retiredPcs * sizeof(uint64_t) +
+                         (uint64_t)header.pages * sizeof(uint32_t);
+        uint64_t pageStart = (fixed + PagedMemory::PageSize - 1) & ~(uint64_t)(PagedMemory::PageSize - 1);
+        if (pageStart + (uint64_t)header.pages * PagedMemory::PageSize > file->size())
+            throw runtime_error(path + ": truncated snapshot");
+
+        reset();
+        p += sizeof(header);
+        auto take = [&](void *to, size_t bytes)
+        {
+            if (bytes)
+                memcpy(to, p, bytes);
+            p += bytes;
+        };
+        take(latchBuffers, sizeof(latchBuffers));
+        take(GPR.data(), GPR.size() * sizeof(Registers));
+        take(&stats, sizeof(stats));
+        unitOps.resize(header.unitOps);
+        take(unitOps.data(), unitOps.size() * sizeof(UnitOperation));
+        take(retiredCounts.data(), retiredCounts.size() * sizeof(uint64_t));
+        vector<uint32_t> pages(header.pages);
+        take(pages.data(), pages.size() * sizeof(uint32_t));
+
+        DM.clear();
+        for (size_t i = 0; i < pages.size(); i++)
+            DM.map(pages[i], file->data() + pageStart + i * PagedMemory::PageSize, PagedMemory::PageSize, PagedMemory::PageSize);
+        snapshotImage = file;
+
+        functionalRetired = header.functionalRetired;
+        unitFree[0] = header.unitFree[0];
+        unitFree[1] = header.unitFree[1];
+        pendingUnit = header.pendingUnit;
+        unitWrites = header.unitWrites;
+        nextTag = header.nextTag;
+        exitStatus = header.exitStatus;
+        fetchEnabled = header.fetchEnabled;
+        halted = header.halted;
+        cur = &latchBuffers[header.curBuffer & 1];
+        nxt = &latchBuffers[~header.curBuffer & 1];
+
+        // The predictor starts cold, so a guess in flight rolls back to its
+        // empty history and return stack
+        for (PipelineLatches &latches : latchBuffers)
+        {
+            latches.ifid.Pred = Prediction{latches.ifid.Pred.NextPc, 0, 0, 0};
+            latches.idex.Pred = Prediction{latches.idex.Pred.NextPc, 0, 0, 0};
+        }
+    }
+
+    // Whether the program has called exit, and with which status
+    bool exited() const { return halted; }
+    int exitCode() const { return exitStatus; }
+
+    // Instructions run by runFunctional() and runTranslated() so far
+    uint64_t functionalInstructions() const { return functionalRetired; }
+
+    // Instructions retired by the pipeline at each PC
+    const vector<uint64_t> &retiredByPc() const { return retiredCounts; }
+
+    // Pipeline cycles charged to each PC, and the call stacks they were
+    // charged under; empty unless config.profileCycles is set
+    const vector<uint64_t> &cyclesByPc() const { return cycleCounts; }
+    const CallProfile &callProfile() const { return calls; }
+
+    // Instructions retired by the pipeline, by mnemonic
+    map<string, uint64_t> opcodeCounts() const
+    {
+        map<string, uint64_t> counts;
+        for (size_t pc = 0; pc < retiredCounts.size(); pc++)
+            if (retiredCounts[pc])
+                counts[mnemonic(program->DecodedMemory[pc])] += retiredCounts[pc];
+        return counts;
+    }
+
+    bool busy() const
+    {
+        return cur->pc.Valid || cur->ifid.Valid || cur->idex.Valid || cur->exmo.Valid || cur->mowb.Valid || !unitOps.empty();
+    }
+
+    void step()
+    {
+        // The register file is written in the first half of the cycle and
+        // read by decode in the second half. The other stages run oldest
+        // first, and execute() must precede fetch(): it resolves branches
+        // against the predictor, restoring its history and return stack on a
+        // misprediction, and fetch() predicts from that state in the same
+        // cycle.
+        if (config.profileCycles)
+            chargeCycles(1);
+        uint64_t fetchStalls = stats.fetchStallCycles;
+        writeBack();
+        resolveHazards();
+
+        memoryOperation();
+        execute();
+        decode();
+        fetch();
+
+        if (trace)
+            traceCycles(1, (uint8_t)hazard.Cause | hazard.StallMEM << 3 | hazard.Redirect << 4 | hazard.UnitBusy << 5 |
+                               (stats.fetchStallCycles != fetchStalls) << 6);
+        swap(cur, nxt);
+
+        stats.cycles++;
+        stats.stallCycles += hazard.StallID;
+        stats.rs1StallCycles += hazard.Cause == StallCause::Rs1;
+        stats.rs2StallCycles += hazard.Cause == StallCause::Rs2;
+        stats.wawStallCycles += hazard.Cause == StallCause::Destination;
+        stats.serializeStallCycles += hazard.Cause == StallCause::Serialize;
+        stats.branches += hazard.Resolve;
+        stats.jumps += hazard.Jump;
+        stats.memoryStallCycles += hazard.StallMEM;
+        stats.unitStallCycles += hazard.UnitBusy;
+        stats.flushes += hazard.Redirect;
+        stats.jumpFlushes += hazard.Redirect && hazard.Jump;
+    }
+
+    // Clocks the pipeline until it drains, or until the total cycle or
+    // retired-instruction count reaches its budget; returns the cycle count
+    uint64_t run(uint64_t maxCycles, uint64_t maxInstructions = UINT64_MAX)
+    {
+        while (stats.cycles < maxCycles && stats.instructions < maxInstructions && busy())
+        {
+            int idle = config.skipIdle ? idleCycles() : 0;
+            if (idle > 0)
+                skipCycles((int)min<uint64_t>(idle, maxCycles - stats.cycles));
+            else
+                step();
+        }
+        return stats.cycles;
+    }
+
+    // Number of upcoming cycles that provably change nothing but a
+    // countdown, and can therefore be skipped in one go
+    int idleCycles() const
+    {
+        // A waiting memory access holds EX, ID and IF; once WB has nothing
+        // left to retire, every cycle until the access completes is identical
+        // except for multiply and divide results being written back
+        if (cur->exmo.Valid && cur->exmo.Wait > 0 && !cur->mowb.Valid)
+        {
+            int64_t idle = cur->exmo.Wait;
+            for (const UnitOperation &op : unitOps)
+                if (op.retired)
+                    idle = min<int64_t>(idle, (int64_t)(op.readyAt - stats.cycles));
+            return (int)max<int64_t>(idle, 0);
+        }
+
+        // Likewise for an instruction cache miss in front of an empty pipeline,
+        // up to the cycle that delivers the instruction
+        if (cur->pc.Valid && cur->pc.Wait > 1 && fetchEnabled && drained())
+            return cur->pc.Wait - 1;
+        return 0;
+    }
+
+    // Advances by n cycles that idleCycles() reported as idle
+    void skipCycles(int n)
+    {
+        if (config.profileCycles)
+            chargeCycles(n);
+        if (trace)
+            traceCycles(n, cur->exmo.Valid && cur->exmo.Wait > 0 ? 0x08 : 0x40);
+        if (cur->exmo.Valid && cur->exmo.Wait > 0)
+        {
+            cur->exmo.Wait -= n;
+            stats.memoryStallCycles += n;
+        }
+        else
+            stats.fetchStallCycles += n;
+        if (cur->pc.Wait > 1)
+            cur->pc.Wait = max(cur->pc.Wait - n, 1);
+        cur->ifid.Stall = false;
+        stats.cycles += n;
+    }
+
+    uint64_t cycleCount() const { return stats.cycles; }
+
+    bool drained() const
+    {
+        return !cur->ifid.Valid && !cur->idex.Valid && !cur->exmo.Valid && !cur->mowb.Valid && unitOps.empty();
+    }
+
+    // Stops fetching and clocks until the in-flight instructions have
+    // retired, leaving the PC at the next instruction to execute
+    void drain()
+    {
+        fetchEnabled = false;
+        while (!drained())
+            step();
+        fetchEnabled = true;
+    }
+
+    // Instruction-set simulation of up to maxInstructions starting at the
+    // current PC, with no timing. It works on the same GPR/DM/PC as the
+    // pipeline, so step()/run() can pick up where it stops. The pipeline must
+    // be drained first. Returns the number of instructions executed.
+    uint64_t runFunctional(uint64_t maxInstructions)
+    {
+        if (!drained())
+            throw logic_error("runFunctional() needs a drained pipeline");
+        if (!cur->pc.Valid)
+            return 0;
+
+        const DecodedInst *code = program->DecodedMemory.data();
+        const int size = (int)program->DecodedMemory.size();
+        int pc = cur->pc.Value;
+        uint64_t retired = 0;
+        const DecodedInst *inst;
+
+#ifdef __GNUC__
+        // Direct-threaded code: one handler address per instruction, so each
+        // handler jumps straight to the next one without a central switch
+        static const void *const handlers[] = {&&AluReg, &&AluImm, &&Load, &&Store, &&Branch, &&Jump, &&Auipc, &&System, &&Invalid};
+        if (threadedProgram != program.get())
+        {
+            threadedCode.clear();
+            for (int i = 0; i < size; i++)
+                threadedCode.push_back(handlers[(int)code[i].Class]);
+            threadedProgram = program.get();
+        }
+        const void *const *threaded = threadedCode.data();
+
+#define ISS_OP(name) name:
+#define ISS_NEXT()                                                 \
+    do                                                             \
+    {                                                              \
+        if (retired == maxInstructions || pc < 0 || pc >= size)    \
+            goto done;                                             \
+        inst = &code[pc];                                          \
+        retired++;                                                 \
+        goto *threaded[pc];                                        \
+    } while (0)
+
+        ISS_NEXT();
+#else
+#define ISS_OP(name) case ExecClass::name:
+#define ISS_NEXT() continue
+
+        for (;;)
+        {
+            if (retired == maxInstructions || pc < 0 || pc >= size)
+                goto done;
+            inst = &code[pc];
+            retired++;
+            switch (inst->Class)
+            {
+#endif
+        ISS_OP(AluReg)
+        {
+            GPR[inst->rd].value = ALU(inst->ALUSel, GPR[inst->rs1].value, GPR[inst->rs2].value);
+            pc++;
+            ISS_NEXT();
+        }
+        ISS_OP(AluImm)
+        {
+            GPR[inst->rd].value = ALU(inst->ALUSel, GPR[inst->rs1].value, inst->imm);
+            pc++;
+            ISS_NEXT();
+        }
+        ISS_OP(Load)
+        {
+            GPR[inst->rd].value = DM.load((uint32_t)GPR[inst->rs1].value + inst->imm, inst->func3);
+            pc++;
+            ISS_NEXT();
+        }
+        ISS_OP(Store)
+        {
+            DM.store((uint32_t)GPR[inst->rs1].value + inst->imm, inst->func3, GPR[inst->rs2].value);
+            pc++;
+            ISS_NEXT();
+        }
+        ISS_OP(Branch)
+        {
+            if (ALUFLAG(GPR[inst->rs1].value, GPR[inst->rs2].value, inst->Cond))
+                pc = branchTarget(pc, inst->imm);
+            else
+                pc++;
+            ISS_NEXT();
+        }
+        ISS_OP(Jump)
+        {
+            int target = inst->CW.Indirect ? program->textIndex(((uint32_t)GPR[inst->rs1].value + inst->imm) & ~1u) : branchTarget(pc, inst->imm);
+            if (inst->CW.RegWrite)
+                GPR[inst->rd].value = program->textAddress(pc + 1);
+            pc = target;
+            ISS_NEXT();
+        }
+        ISS_OP(Auipc)
+        {
+            GPR[inst->rd].value = program->textAddress(pc) + inst->imm;
+            pc++;
+            ISS_NEXT();
+        }
+        ISS_OP(System)
+        {
+            // The functional simulator counts one cycle per instruction
+            uint64_t before = functionalRetired + retired - 1;
+            GPR[inst->rd].value = systemInstruction(*inst, before, before);
+            pc = halted ? -1 : pc + 1;
+            ISS_NEXT();
+        }
+        ISS_OP(Invalid)
+        {
+            pc++;
+            ISS_NEXT();
+        }
+#ifndef __GNUC__
+            }
+        }
+#endif
+#undef ISS_OP
+#undef ISS_NEXT
+
+    done:
+        cur->pc = PC(pc, pc >= 0 && pc < size);
+        functionalRetired += retired;
+        return retired;
+    }
+
+    // Same as runFunctional(), but executes whole basic blocks from the
+    // translation cache. A block that does not fit in the remaining budget
+    // is finished by runFunctional() so the count stays exact.
+    uint64_t runTranslated(uint64_t maxInstructions)
+    {
+        if (!drained())
+            throw logic_error("runTranslated() needs a drained pipeline");
+
+        const int size = (int)program->DecodedMemory.size();
+        Registers *gpr = GPR.data();
+        PagedMemory *dm = &DM;
+        uint64_t retired = 0;
+
+        while (cur->pc.Valid && retired < maxInstructions)
+        {
+            auto found = blockCache.find(cur->pc.Value);
+            if (found == blockCache.end())
+                found = blockCache.emplace(cur->pc.Value, translateBlock(*program, cur->pc.Value)).first;
+            TranslatedBlock &block = found->second;
+
+            if ((uint64_t)block.length > maxInstructions - retired)
+            {
+                retired += runFunctional(maxInstructions - retired);
+                break;
+            }
+
+            block.executions++;
+            const MicroOp *op = block.body.data();
+            const MicroOp *end = op + block.body.size();
+            while (op < end)
+            {
+                op->run(gpr, dm, op);
+                op += op->length;
+            }
+
+            int next = block.nextPc;
+            if (block.exit == TranslatedBlock::Branch)
+            {
+                if (ALUFLAG(gpr[block.rs1].value, gpr[block.rs2].value, block.cond))
+                    next = block.takenPc;
+            }
+            else if (block.exit == TranslatedBlock::Jump)
+            {
+                next = block.indirect ? program->textIndex(((uint32_t)gpr[block.rs1].value + block.imm) & ~1u) : block.takenPc;
+                if (block.link)
+                    gpr[block.rd].value = block.linkAddress;
+            }
+            else if (block.exit == TranslatedBlock::SystemCall)
+            {
+                uint64_t before = functionalRetired + block.length - 1;
+                gpr[block.rd].value = systemInstruction(program->DecodedMemory[block.nextPc - 1], before, before);
+                if (halted)
+                    next = -1;
+            }
+
+            retired += block.length;
+            functionalRetired += block.length;
+            cur->pc = PC(next, next >= 0 && next < size);
+        }
+        return retired;
+    }
+
+    // Prediction counts of every branch and jump resolved so far, by PC
+    const map<int, BranchPredictor::Accuracy> &branchProfile() const { return predictor.profile(); }
+
+    const Program &currentProgram() const { return *program; }
+
+    const Cache &instructionCache() const { return icache; }
+    const Cache &dataCache() const { return dcache; }
+    const MemoryBackend &memorySystem() const { return backend; }
+
+    // Translated blocks, most executed first
+    vector<const TranslatedBlock *> blockProfile() const
+    {
+        vector<const TranslatedBlock *> blocks;
+        for (auto &entry : blockCache)
+            blocks.push_back(&entry.second);
+        sort(blocks.begin(), blocks.end(), [](const TranslatedBlock *a, const TranslatedBlock *b)
+             { return a->executions != b->executions ? a->executions > b->executions : a->startPc < b->startPc; });
+        return blocks;
+    }
+
+private:
+    shared_ptr<const Program> program;
+
+    PipelineLatches latchBuffers[2];
+    PipelineLatches *cur;
+    PipelineLatches *nxt;
+    HazardSignals hazard;
+    bool fetchEnabled;
+    bool halted; // set by the exit system call
+    int exitStatus;
+    uint64_t functionalRetired;
+    vector<uint64_t> retiredCounts;
+    vector<uint64_t> cycleCounts;
+    CallProfile calls;
+    int lastRetired;
+    shared_ptr<const MappedFile> snapshotImage; // backs the pages of a restored DM
+
+    // Multi-cycle units: operations in flight, the cycle from which each
+    // unit accepts a new one, registers they will write, and registers
+    // they wrote this cycle
+    vector<UnitOperation> unitOps;
+    uint64_t unitFree[2];
+    uint32_t pendingUnit;
+    uint32_t unitWrites;
+    uint32_t nextTag;
+    BranchPredictor predictor;
+    Cache icache;
+    Cache dcache;
+    MemoryBackend backend;
+
+    // Threaded code of the functional simulator, rebuilt when the program changes
+    vector<const void *> threadedCode;
+    const Program *threadedProgram = nullptr;
+
+    // Basic blocks translated so far, keyed by start PC
+    unordered_map<int, TranslatedBlock> blockCache;
+
+    // Result of an ECALL or a CSR instruction, executed after instret
+    // instructions and cycles cycles. The cycle, time and instret counters
+    // (and their upper halves) are readable; other CSRs read as zero.
+    int systemInstruction(const DecodedInst &inst, uint64_t instret, uint64_t cycles)
+    {
+        if (inst.func3 == 0)
+            return systemCall();
+
+        switch (inst.imm & 0xFFF)
+        {
+        case 0xC00: // cycle
+        case 0xC01: // time
+            return (int)cycles;
+        case 0xC02: // instret
+            return (int)instret;
+        case 0xC80:
+        case 0xC81:
+            return (int)(cycles >> 32);
+        case 0xC82:
+            return (int)(instret >> 32);
+        }
+        return 0;
+    }
+
+    // Emulates the Linux system call numbered in a7, with its arguments in
+    // a0..a2, and returns the new a0. Only exit and write are provided;
+    // anything else fails with -ENOSYS.
+    int systemCall()
+    {
+        int arg0 = GPR[10].value;
+        switch (GPR[17].value)
+        {
+        case 93: // exit
+        case 94: // exit_group
+            halted = true;
+            exitStatus = arg0;
+            return arg0;
+        case 64: // write
+        {
+            if (arg0 != 1 && arg0 != 2)
+                return -9; // EBADF
+            uint32_t buffer = GPR[11].value, count = GPR[12].value;
+            if (console)
+            {
+                string text(count, '\0');
+                for (uint32_t i = 0; i < count; i++)
+                    text[i] = DM.read8(buffer + i);
+                *console << text << flush;
+            }
+            return (int)count;
+        }
+        }
+        return -38;
+    }
+
+    void fetch()
+    {
+        IFID &ifid = nxt->ifid;
+        PC &pc = nxt->pc;
+
+        // IFID is kept by decode; a pending miss keeps filling but the
+        // instruction is only delivered once IF moves again
+        if (hazard.HoldIF)
+        {
+            pc = cur->pc;
+            if (pc.Wait > 1)
+                pc.Wait--;
+            return;
+        }
+
+        pc = cur->pc;
+        if (hazard.Redirect)
+            pc = PC(hazard.Target, true); // drops a miss on the wrong path
+
+        if (halted)
+            pc.Valid = false;
+        if (!pc.Valid || !fetchEnabled)
+        {
+            ifid.Valid = false;
+            return;
+        }
+
+        if (pc.Wait > 0 ? --pc.Wait > 0 : fetchMisses(pc))
+        {
+            ifid.Valid = false;
+            stats.fetchStallCycles++;
+            return;
+        }
+
+        if (pc.Value < 0 || pc.Value >= (int)program->InstructionMemory.size())
+        {
+            ifid.Valid = false;
+            pc.Valid = false;
+            return;
+        }
+        else
+        {
+            ifid.IR = program->InstructionMemory[pc.Value];
+            ifid.DPC = pc.Value;
+            ifid.NPC = pc.Value + 1;
+            ifid.Pred = predictor.predict(pc.Value);
+            ifid.Stall = false;
+            ifid.Valid = true;
+            pc.Value = ifid.Pred.NextPc;
+        }
+    }
+
+    // Looks the fetch address up in the instruction cache and starts the
+    // countdown of a miss; true if the instruction is not there yet
+    bool fetchMisses(PC &pc)
+    {
+        if (!icache.enabled() || pc.Value < 0 || pc.Value >= (int)program->InstructionMemory.size())
+            return false;
+        pc.Wait = icache.access(program->textAddress(pc.Value), false, pc.Value, stats.cycles);
+        return pc.Wait > 0;
+    }
+
+    // Whether decode can issue a reader of reg this cycle: either no write
+    // is pending, or the youngest writer is where a bypass path can deliver
+    // its result when the reader reaches EX
+    bool sourceReady(int reg) const
+    {
+        const MOWB &mowb = cur->mowb;
+        if (!config.forwardWBtoID && mowb.Valid && mowb.CW.RegWrite && mowb.RDL == reg)
+            return false;
+
+        // Multiply and divide results are only passed on by the register file
+        if ((pendingUnit >> reg) & 1)
+            return false;
+        if (!config.forwardWBtoID && ((unitWrites >> reg) & 1))
+            return false;
+
+        if (GPR[reg].valid == 0)
+            return true;
+
+        uint32_t producer = GPR[reg].producer;
+        const IDEX &idex = cur->idex;
+        if (idex.Valid && idex.Tag == producer)
+            return config.forwardEXtoEX && !idex.CW.MemRead; // load-use: one bubble
+        if (cur->exmo.Valid && cur->exmo.Tag == producer)
+            return config.forwardMEMtoEX;
+        return false;
+    }
+
+    // ECALL reads the architectural registers and may end the program, and
+    // a counter read must see every older instruction retired, so nothing
+    // younger is decoded until either has written back
+    bool systemCallPending() const
+    {
+        return (cur->idex.Valid && cur->idex.CW.System) || (cur->exmo.Valid && cur->exmo.CW.System) ||
+               (!config.forwardWBtoID && cur->mowb.Valid && cur->mowb.CW.System);
+    }
+
+    // Reason decode cannot issue inst this cycle, if any
+    StallCause stallCause(const DecodedInst &inst) const
+    {
+        if (systemCallPending())
+            return StallCause::Serialize;
+        if (inst.CW.RegRead && !sourceReady(inst.rs1))
+            return StallCause::Rs1;
+        if (inst.CW.RegRead && !sourceReady(inst.rs2))
+            return StallCause::Rs2;
+        if (!destinationReady(inst))
+            return StallCause::Destination;
+        return StallCause::None;
+    }
+
+    // A multiply or divide in flight holds back younger writers of its
+    // destination, which would otherwise write first, and ECALLs, which
+    // read the registers in WB
+    bool destinationReady(const DecodedInst &inst) const
+    {
+        if (inst.CW.System)
+            return pendingUnit == 0;
+        return !inst.CW.RegWrite || !((pendingUnit >> inst.rd) & 1);
+    }
+
+    // Unit executing an ALU operation: 0 the multiplier, 1 the divider, -1
+    // if it stays in the single-cycle ALU
+    int unitOf(AluOp op) const
+    {
+        int unit;
+        switch (op)
+        {
+        case AluOp::MUL:
+        case AluOp::MULH:
+        case AluOp::MULHSU:
+        case AluOp::MULHU:
+            unit = 0;
+            break;
+        case AluOp::DIV:
+        case AluOp::DIVU:
+        case AluOp::REM:
+        case AluOp::REMU:
+            unit = 1;
+            break;
+        default:
+            return -1;
+        }
+        const FunctionalUnitConfig &fu = unit == 0 ? config.multiplier : config.divider;
+        return fu.latency > 1 || fu.interval > 1 ? unit : -1;
+    }
+
+    // Value of a source operand as EX sees it: from the register file read
+    // in ID, or bypassed from the latch currently holding its producer
+    int operand(bool pending, uint32_t producer, int reg, int value) const
+    {
+        if (!pending)
+            return value;
+        if (cur->exmo.Valid && cur->exmo.Tag == producer)
+            return cur->exmo.ALUOUT;
+        if (cur->mowb.Valid && cur->mowb.Tag == producer)
+            return cur->mowb.CW.Mem2Reg ? cur->mowb.LDOUT : cur->mowb.ALUOUT;
+        return GPR[reg].value; // written back while the consumer was held
+    }
+
+    // ALU inputs and store data of the instruction in EX
+    void executeOperands(const IDEX &idex, int &a, int &b, int &storeData) const
+    {
+        a = operand(idex.Fwd1, idex.SrcTag1, idex.Src1, idex.RS1);
+        if (idex.CW.ALUSrc)
+        {
+            b = idex.RS2;
+            storeData = operand(idex.Fwd2, idex.SrcTag2, idex.Src2, idex.RS22);
+        }
+        else
+        {
+            b = operand(idex.Fwd2, idex.SrcTag2, idex.Src2, idex.RS2);
+            storeData = idex.RS22;
+        }
+    }
+
+    void decode()
+    {
+        const IFID &ifid = cur->ifid;
+        IDEX &idex = nxt->idex;
+
+        if (hazard.HoldID)
+        {
+            nxt->ifid = ifid;
+            nxt->ifid.Stall = hazard.StallID;
+            if (!hazard.HoldEX)
+                idex.Valid = false;
+            return;
+        }
+
+        if (!ifid.Valid || hazard.Redirect || halted)
+        {
+            idex.Valid = false;
+            return;
+        }
+
+        const DecodedInst &inst = program->DecodedMemory[ifid.DPC];
+        idex.CW = inst.CW;
+
+        idex.pc2.Dpc = ifid.DPC;
+        // Only branches and JAL carry a PC-relative offset; other formats leave
+        // imm as INT_MIN or a plain operand
+        idex.pc2.Jpc = inst.CW.Branch || (inst.CW.Jump && !inst.CW.Indirect) ? branchTarget(ifid.DPC, inst.imm) : 0;
+        idex.Pred = ifid.Pred;
+
+        idex.imm1 = inst.imm;
+
+        idex.ALUSel = inst.ALUSel;
+        idex.Cond = inst.Cond;
+
+        idex.RDL = inst.rd;
+
+        // Sources with a write still in flight are picked up in EX
+        idex.Tag = nextTag++;
+        idex.Src1 = inst.rs1;
+        idex.Src2 = inst.rs2;
+        idex.Fwd1 = idex.CW.RegRead && GPR[inst.rs1].valid != 0;
+        idex.Fwd2 = idex.CW.RegRead && GPR[inst.rs2].valid != 0;
+        idex.SrcTag1 = GPR[inst.rs1].producer;
+        idex.SrcTag2 = GPR[inst.rs2].producer;
+
+        if (idex.CW.RegRead)
+            idex.RS1 = GPR[inst.rs1].value;
+        else if (idex.CW.PcOperand)
+            idex.RS1 = program->textAddress(ifid.DPC);
+
+        if (idex.CW.ALUSrc)
+        {
+            idex.RS2 = idex.imm1;
+            if (idex.CW.RegRead)
+                idex.RS22 = GPR[inst.rs2].value;
+        }
+        else if (idex.CW.RegRead)
+            idex.RS2 = GPR[inst.rs2].value;
+
+        if (idex.CW.RegWrite)
+        {
+            GPR[idex.RDL].valid += 1;
+            GPR[idex.RDL].producer = idex.Tag;
+        }
+
+        idex.Unit = inst.Class == ExecClass::AluReg ? unitOf(inst.ALUSel) : -1;
+        if (idex.Unit >= 0 && idex.CW.RegWrite)
+            pendingUnit |= 1u << idex.RDL;
+
+        idex.Valid = true;
+    }
+
+    void execute()
+    {
+        const IDEX &idex = cur->idex;
+        EXMO &exmo = nxt->exmo;
+
+        // EXMO is kept by memoryOperation() while MEM waits
+        if (hazard.HoldEX)
+        {
+            nxt->idex = idex;
+            if (!hazard.StallMEM)
+                exmo.Valid = false;
+            return;
+        }
+
+        if (!idex.Valid)
+        {
+            exmo.Valid = false;
+            return;
+        }
+
+        int a, b, storeData;
+        executeOperands(idex, a, b, storeData);
+        exmo.ALUOUT = idex.CW.Jump ? (int)program->textAddress(idex.pc2.Dpc + 1) : ALU(idex.ALUSel, a, b);
+
+        exmo.CW = idex.CW;
+        exmo.RDL = idex.RDL;
+        exmo.RS2 = storeData;
+        exmo.Tag = idex.Tag;
+        exmo.Dpc = idex.pc2.Dpc;
+        if (idex.Unit >= 0)
+        {
+            // The instruction moves on; its unit writes the result later
+            const FunctionalUnitConfig &fu = idex.Unit == 0 ? config.multiplier : config.divider;
+            unitFree[idex.Unit] = stats.cycles + fu.interval;
+            unitOps.push_back(UnitOperation{idex.Tag, stats.cycles + fu.latency + 1, exmo.ALUOUT, (uint8_t)idex.RDL, idex.CW.RegWrite, false});
+            exmo.CW.RegWrite = false;
+        }
+        if (hazard.Resolve)
+            predictor.resolve(idex.pc2.Dpc, program->DecodedMemory[idex.pc2.Dpc], idex.Pred, hazard.Taken, hazard.Destination);
+        exmo.Wait = 0;
+        if (idex.CW.MemRead || idex.CW.MemWrite)
+        {
+            // The tags are looked up as the access enters MEM, so the stage
+            // knows how long to hold it.
+            exmo.Wait = config.memoryLatency;
+            if (dcache.enabled())
+                exmo.Wait += dcache.access(exmo.ALUOUT, idex.CW.MemWrite, idex.pc2.Dpc, stats.cycles);
+        }
+        exmo.Valid = true;
+    }
+
+    void memoryOperation()
+    {
+        const EXMO &exmo = cur->exmo;
+        MOWB &mowb = nxt->mowb;
+
+        if (hazard.StallMEM)
+        {
+            nxt->exmo = exmo;
+            nxt->exmo.Wait--;
+            mowb.Valid = false;
+            return;
+        }
+
+        if (!exmo.Valid)
+        {
+            mowb.Valid = false;
+            return;
+        }
+
+        if (exmo.CW.MemWrite)
+        {
+            DM.store(exmo.ALUOUT, exmo.CW.Width, exmo.RS2);
+            if (log)
+                *log << " DM[" << exmo.ALUOUT << "] =  " << exmo.RS2 << '\n';
+            if (trace)
+                trace->memoryWrite(exmo.ALUOUT, exmo.CW.Width, exmo.RS2);
+        }
+        if (exmo.CW.MemRead)
+            mowb.LDOUT = DM.load(exmo.ALUOUT, exmo.CW.Width);
+
+        mowb.ALUOUT = exmo.ALUOUT;
+
+        mowb.CW = exmo.CW;
+        mowb.RDL = exmo.RDL;
+        mowb.Tag = exmo.Tag;
+        mowb.Dpc = exmo.Dpc;
+        mowb.Valid = true;
+    }
+
+    void traceCycles(uint64_t n, uint8_t events)
+    {
+        const PipelineLatches &l = *cur;
+        int pcs[5] = {l.pc.Valid ? l.pc.Value : -1, l.ifid.Valid ? l.ifid.DPC : -1, l.idex.Valid ? l.idex.pc2.Dpc : -1,
+                      l.exmo.Valid ? l.exmo.Dpc : -1, l.mowb.Valid ? l.mowb.Dpc : -1};
+        trace->cycles(stats.cycles, n, pcs, events);
+    }
+
+    // Charges cycles to the oldest instruction in the pipeline: the one in
+    // WB, or else the one stalled furthest along. With nothing in flight
+    // they go to the last instruction retired.
+    void chargeCycles(uint64_t n)
+    {
+        const PipelineLatches &l = *cur;
+        int pc = l.mowb.Valid ? l.mowb.Dpc : l.exmo.Valid ? l.exmo.Dpc : l.idex.Valid ? l.idex.pc2.Dpc
+                                                                       : l.ifid.Valid ? l.ifid.DPC : -1;
+        if (pc < 0)
+            pc = l.pc.Valid && l.pc.Value >= 0 && l.pc.Value < (int)cycleCounts.size() ? l.pc.Value : lastRetired;
+        if (pc < 0 || pc >= (int)cycleCounts.size())
+            return; // an empty program has no instruction to charge
+        cycleCounts[pc] += n;
+        calls.charge(pc, n);
+    }
+
+    void writeBack()
+    {
+        const MOWB &mowb = cur->mowb;
+
+        unitWrites = 0;
+        if (!unitOps.empty())
+            completeUnitOperations(mowb);
+
+        if (!mowb.Valid)
+            return;
+        uint64_t retiredBefore = stats.instructions++;
+        retiredCounts[mowb.Dpc]++;
+        if (config.profileCycles)
+        {
+            lastRetired = mowb.Dpc;
+            if (mowb.CW.Jump)
+                calls.retire(program->DecodedMemory[mowb.Dpc]);
+        }
+        if (!mowb.CW.RegWrite)
+            return;
+
+        if (mowb.CW.Mem2Reg && GPR[mowb.RDL].valid > 0)
+            GPR[mowb.RDL].value = mowb.LDOUT;
+        else if (mowb.CW.System)
+        {
+            // Everything older has retired
+            uint64_t before = functionalRetired + retiredBefore;
+            GPR[mowb.RDL].value = systemInstruction(program->DecodedMemory[mowb.Dpc], before, functionalRetired + stats.cycles);
+        }
+        else
+            GPR[mowb.RDL].value = mowb.ALUOUT;
+        GPR[mowb.RDL].valid -= 1;
+
+        if (log)
+            *log << " GPR[" << mowb.RDL << "] = " << GPR[mowb.RDL].value << '\n';
+        if (trace)
+            trace->registerWrite(mowb.RDL, GPR[mowb.RDL].value);
+    }
+
+    // Writes back the multiplies and divides that are ready and whose
+    // instruction has reached WB
+    void completeUnitOperations(const MOWB &mowb)
+    {
+        for (size_t i = 0; i < unitOps.size();)
+        {
+            UnitOperation &op = unitOps[i];
+            if (mowb.Valid && mowb.Tag == op.tag)
+                op.retired = true;
+            if (!op.retired || op.readyAt > stats.cycles)
+            {
+                i++;
+                continue;
+            }
+
+            if (op.write)
+            {
+                GPR[op.rd].value = op.value;
+                GPR[op.rd].valid -= 1;
+                pendingUnit &= ~(1u << op.rd);
+                unitWrites |= 1u << op.rd;
+                if (log)
+                    *log << " GPR[" << (int)op.rd << "] = " << op.value << '\n';
+                if (trace)
+                    trace->registerWrite(op.rd, op.value);
+            }
+            unitOps.erase(unitOps.begin() + i);
+        }
+    }
+
+    void resolveHazards()
+    {
+        const IDEX &idex = cur->idex;
+
+        hazard.StallMEM = cur->exmo.Valid && cur->exmo.Wait > 0;
+        hazard.UnitBusy = !hazard.StallMEM && idex.Valid && idex.Unit >= 0 && unitFree[idex.Unit] > stats.cycles;
+        hazard.HoldEX = hazard.StallMEM || hazard.UnitBusy;
+
+        // A held branch resolves once it actually leaves EX, and redirects
+        // fetch if it went elsewhere
+        hazard.Resolve = !hazard.HoldEX && idex.Valid && (idex.CW.Branch || idex.CW.Jump);
+        hazard.Redirect = false;
+        if (hazard.Resolve)
+        {
+            int a, b, storeData;
+            executeOperands(idex, a, b, storeData);
+            if (idex.CW.Jump)
+            {
+                hazard.Taken = true;
+                hazard.Destination = idex.CW.Indirect ? program->textIndex(((uint32_t)a + b) & ~1u) : idex.pc2.Jpc;
+            }
+            else
+            {
+                hazard.Taken = ALUFLAG(a, b, idex.Cond);
+                hazard.Destination = branchTarget(idex.pc2.Dpc, idex.imm1);
+            }
+            hazard.Target = hazard.Taken ? hazard.Destination : idex.pc2.Dpc + 1;
+            hazard.Redirect = hazard.Target != idex.Pred.NextPc;
+        }
+
+        hazard.Jump = hazard.Resolve && idex.CW.Jump;
+        hazard.Cause = StallCause::None;
+        if (!hazard.HoldEX && cur->ifid.Valid && !hazard.Redirect && !halted)
+            hazard.Cause = stallCause(program->DecodedMemory[cur->ifid.DPC]);
+        hazard.StallID = hazard.Cause != StallCause::None;
+        hazard.HoldID = hazard.HoldEX || hazard.StallID;
+        hazard.HoldIF = hazard.HoldID;
+    }
+};
+
+// Program of assembled source: .text from address 0, .data at DataBase, and
+// the .text labels as symbols
+shared_ptr<const Program> makeProgram(AssembledProgram assembled)
+{
+    auto program = make_shared<Program>(move(assembled.text));
+    for (const auto &label : assembled.labels)
+    {
+        if (label.second >= DataBase)
+            continue;
+        // Of several labels on one instruction, the first in name order wins
+        auto symbol = program->Symbols.emplace(label.second, string(label.first)).first;
+        if (label.first < symbol->second)
+            symbol->second = string(label.first);
+    }
+    if (!assembled.data.empty())
+    {
+        auto data = make_shared<const vector<uint8_t>>(move(assembled.data));
+        program->Segments.push_back(Segment{DataBase, data->data(), (uint32_t)data->size(), (uint32_t)data->size()});
+        program->Image = data;
+    }
+    return program;
+}
+
+// Assembles a program given as one line of source per string
+shared_ptr<const Program> assembleProgram(const vector<string> &assemblyLang)
+{
+    string source;
+    for (const auto &line : assemblyLang)
+        source += line + '\n';
+    return makeProgram(assembleSource(source));
+}
+
+// Reads the non-empty lines of a text file, dropping '#' comments and
+// surrounding whitespace
+vector<string> readSourceLines(const string &path)
+{
+    ifstream in(path);
+    if (!in)
+        throw runtime_error("cannot open " + path);
+
+    vector<string> lines;
+    string line;
+    while (getline(in, line))
+    {
+        line = line.substr(0, line.find('#'));
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos)
+            continue;
+        size_t last = line.find_last_not_of(" \t\r");
+        lines.push_back(line.substr(first, last - first + 1));
+    }
+    return lines;
+}
+
+uint32_t imageWord(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+uint16_t imageHalf(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+// Collects the STT_FUNC entries of the SHT_SYMTAB section, if the file has
+// one. A stripped or malformed table just leaves the map empty.
+void loadElfSymbols(const uint8_t *image, size_t size, map<uint32_t, string> &symbols)
+{
+    uint32_t shoff = imageWord(image + 32);
+    uint16_t shentsize = imageHalf(image + 46), shnum = imageHalf(image + 48);
+    if (shoff == 0 || shentsize < 40 || (uint64_t)shoff + (uint64_t)shnum * shentsize > size)
+        return;
+
+    for (int i = 0; i < shnum; i++)
+    {
+        const uint8_t *section = image + shoff + i * shentsize;
+        uint32_t link = imageWord(section + 24);
+        if (imageWord(section + 4) != 2 || link >= shnum) // SHT_SYMTAB
+            continue;
+        uint32_t offset = imageWord(section + 16), bytes = imageWord(section + 20);
+        const uint8_t *strtab = image + shoff + link * shentsize;
+        uint32_t namesOffset = imageWord(strtab + 16), namesSize = imageWord(strtab + 20);
+        if ((uint64_t)offset + bytes > size || (uint64_t)namesOffset + namesSize > size)
+            return;
+
+        for (uint32_t entry = 0; entry + 16 <= bytes; entry += 16)
+        {
+            const uint8_t *symbol = image + offset + entry;
+            uint32_t name = imageWord(symbol);
+            if ((symbol[12] & 0xf) != 2 || name >= namesSize) // STT_FUNC
+                continue;
+            const char *text = (const char *)image + namesOffset + name;
+            symbols.emplace(imageWord(symbol + 4), string(text, strnlen(text, namesSize - name)));
+        }
+        return;
+    }
+}
+
+// Loads the PT_LOAD segments of a little-endian ELF32 RISC-V executable. The
+// executable segment holding the entry point becomes the instruction memory.
+shared_ptr<const Program> loadElf(const shared_ptr<const MappedFile> &file, const string &path)
+{
+    const uint8_t *image = file->data();
+    size_t size = file->size();
+    if (size < 52 || image[4] != 1 || image[5] != 1 || imageHalf(image + 18) != 243)
+        throw runtime_error(path + ": not a little-endian ELF32 RISC-V file");
+
+    uint32_t entry = imageWord(image + 24);
+    uint32_t phoff = imageWord(image + 28);
+    uint16_t phentsize = imageHalf(image + 42), phnum = imageHalf(image + 44);
+    if (phentsize < 32 || (uint64_t)phoff + (uint64_t)phnum * phentsize > size)
+        throw runtime_error(path + ": program headers outside the file");
+
+    vector<Segment> segments;
+    int text = -1;
+    for (int i = 0; i < phnum; i++)
+    {
+        const uint8_t *header = image + phoff + i * phentsize;
+        if (imageWord(header) != 1) // PT_LOAD
+            continue;
+        uint32_t offset = imageWord(header + 4), vaddr = imageWord(header + 8);
+        uint32_t fileSize = imageWord(header + 16), memSize = imageWord(header + 20);
+        if ((uint64_t)offset + fileSize > size || fileSize > memSize)
+            throw runtime_error(path + ": segment outside the file");
+
+        if ((imageWord(header + 24) & 1) && entry >= vaddr && entry - vaddr < fileSize) // PF_X
+            text = segments.size();
+        segments.push_back(Segment{vaddr, image + offset, fileSize, memSize});
+    }
+    if (text < 0 || (entry - segments[text].vaddr) % 4 != 0)
+        throw runtime_error(path + ": entry point is not an instruction of an executable segment");
+
+    auto program = make_shared<Program>(segments[text].data, segments[text].fileSize, segments[text].vaddr);
+    program->Entry = (entry - segments[text].vaddr) / 4;
+    program->Segments = move(segments);
+    loadElfSymbols(image, size, program->Symbols);
+    program->Image = file;
+    return program;
+}
+
+// Loads a program file: an ELF32 executable, a raw binary (*.bin) placed and
+// entered at rawBase, or otherwise assembly source. Binaries are mapped,
+// not read, and their bytes are shared by every core running them.
+shared_ptr<const Program> loadProgram(const string &path, uint32_t rawBase = 0)
+{
+    auto file = make_shared<const MappedFile>(path);
+    if (file->size() >= 4 && memcmp(file->data(), "\x7f" "ELF", 4) == 0)
+        return loadElf(file, path);
+
+    if (path.size() > 4 && path.compare(path.size() - 4, 4, ".bin") == 0)
+    {
+        auto program = make_shared<Program>(file->data(), file->size(), rawBase);
+        program->Segments.push_back(Segment{rawBase, file->data(), (uint32_t)file->size(), (uint32_t)file->size()});
+        program->Image = file;
+        return program;
+    }
+
+    try
+    {
+        return makeProgram(assembleSource(string_view((const char *)file->data(), file->size())));
+    }
+    catch (const runtime_error &ex)
+    {
+        throw runtime_error(path + ": " + ex.what());
+    }
+}
+
+struct SimOptions
+{
+    CoreConfig config;
+    uint64_t maxCycles = UINT64_MAX;
+    uint64_t maxInstructions = UINT64_MAX;
+    uint64_t interval = 0;         // cycles per interval statistics line, 0 for none
+    ostream *intervalOut = &cout;
+    ostream *statsOut = nullptr; // JSON counters at the end of the run
+    uint64_t fastForward = 0; // instructions run functionally before the pipeline takes over
+    bool functional = false;  // functional simulation only
+    bool translate = false;   // functional part runs from the basic-block translation cache
+    bool blockProfile = false;
+    bool branchProfile = false;
+    bool cacheProfile = false; // per-PC and per-region cache counters
+    bool cycleProfile = false; // cycles charged to each basic block and PC
+    ostream *foldedOut = nullptr; // cycles by call stack, for flame graphs
+    TraceWriter *trace = nullptr; // binary per-cycle trace of the pipeline
+    string restorePath;    // snapshot to start from
+    string checkpointPath; // snapshot to write at the end of the run
+    uint32_t loadAddress = 0;  // where raw binaries are placed
+};
+
+// Calls handle(key, value) for each item of a comma-separated list of
+// key=value settings; handle returns false for a key it does not know
+template <typename Handler>
+void forEachSetting(const string &spec, const string &kind, Handler handle)
+{
+    stringstream list(spec);
+    string item;
+    while (getline(list, item, ','))
+    {
+        size_t eq = item.find('=');
+        string value = eq == string::npos ? "" : item.substr(eq + 1);
+        if (!handle(item.substr(0, eq), value))
+            throw invalid_argument("bad " + kind + " setting '" + item + "'");
+    }
+}
+
+// Whole-number value of a key=value setting, which must be in minimum..maximum
+int64_t settingValue(const string &key, const string &value, int64_t minimum, int64_t maximum = INT_MAX)
+{
+    int64_t result;
+    if (!parseInteger(value, result) || result < minimum || result > maximum)
+        throw invalid_argument("bad value for " + key + ": '" + value + "'");
+    return result;
+}
+
+// Parses a comma-separated list of key=value settings such as
+// "size=4096,ways=4,line=32,replacement=plru,write=through,allocate=no"
+CacheConfig parseCacheConfig(const string &spec, CacheConfig config = CacheConfig())
+{
+    forEachSetting(spec, "cache", [&](const string &key, const string &value)
+                   {
+                       if (key == "size")
+                           config.sizeBytes = settingValue(key, value, 0, UINT32_MAX);
+                       else if (key == "ways")
+                           config.ways = settingValue(key, value, 1);
+                       else if (key == "line")
+                           config.lineBytes = settingValue(key, value, 1);
+                       else if (key == "hit")
+                           config.hitLatency = settingValue(key, value, 0);
+                       else if (key == "miss")
+                           config.missLatency = settingValue(key, value, 0);
+                       else if (key == "region")
+                           config.regionBytes = settingValue(key, value, 1, UINT32_MAX);
+                       else if (key == "replacement" && (value == "lru" || value == "plru" || value == "random"))
+                           config.replacement = value == "lru" ? Replacement::LRU : value == "plru" ? Replacement::PLRU : Replacement::Random;
+                       else if (key == "write" && (value == "back" || value == "through"))
+                           config.writeBack = value == "back";
+                       else if (key == "allocate" && (value == "yes" || value == "no"))
+                           config.writeAllocate = value == "yes";
+                       else if (key == "prefetch" && (value == "none" || value == "next-line" || value == "stream" || value == "stride"))
+                           config.prefetcher = value == "none" ? PrefetcherKind::None : value == "next-line" ? PrefetcherKind::NextLine
+                                               : value == "stream"                    ? PrefetcherKind::Stream
+                                                                                      : PrefetcherKind::Stride;
+                       else if (key == "degree")
+                           config.prefetchDegree = settingValue(key, value, 1);
+                       else
+                           return false;
+                       return true;
+                   });
+    return config;
+}
+
+void printCacheCounters(ostream &out, const CacheCounters &c)
+{
+    out << c.accesses << " accesses, " << c.hits << " hits, " << c.misses << " misses, "
+        << c.evictions << " evictions, " << c.writebacks << " writebacks";
+    if (c.writeThroughs)
+        out << ", " << c.writeThroughs << " writes through";
+}
+
+// Parses "banks=8,row=2048,page=open,trcd=14,tcas=14,trp=14,burst=4"
+DramConfig parseDramConfig(const string &spec, DramConfig config = DramConfig())
+{
+    forEachSetting(spec, "DRAM", [&](const string &key, const string &value)
+                   {
+                       if (key == "banks")
+                           config.banks = settingValue(key, value, 1);
+                       else if (key == "row")
+                           config.rowBytes = settingValue(key, value, 1, UINT32_MAX);
+                       else if (key == "trcd")
+                           config.tRCD = settingValue(key, value, 0);
+                       else if (key == "tcas")
+                           config.tCAS = settingValue(key, value, 0);
+                       else if (key == "trp")
+                           config.tRP = settingValue(key, value, 0);
+                       else if (key == "burst")
+                           config.tBurst = settingValue(key, value, 0);
+                       else if (key == "page" && (value == "open" || value == "closed"))
+                           config.openPage = value == "open";
+                       else
+                           return false;
+                       return true;
+                   });
+    return config;
+}
+
+// Parses "latency=4,interval=1"
+FunctionalUnitConfig parseUnitConfig(const string &spec, FunctionalUnitConfig config = FunctionalUnitConfig())
+{
+    forEachSetting(spec, "functional unit", [&](const string &key, const string &value)
+                   {
+                       if (key == "latency")
+                           config.latency = settingValue(key, value, 1);
+                       else if (key == "interval")
+                           config.interval = settingValue(key, value, 1);
+                       else
+                           return false;
+                       return true;
+                   });
+    return config;
+}
+
+// Settings of sampled simulation (--simpoint)
+struct SimPointConfig
+{
+    uint64_t interval = 10000000; // instructions per interval
+    uint64_t warmup = 1000000;    // detailed instructions run before each measured interval
+    int maxClusters = 10;
+    int samples = 2;     // intervals simulated per cluster; two or more give error bounds
+    int dimensions = 15; // of the random projection
+    uint64_t seed = 1;
+};
+
+// Parses "interval=N,warmup=N,k=N,samples=N,dims=N,seed=N"
+SimPointConfig parseSimPointConfig(const string &spec, SimPointConfig config = SimPointConfig())
+{
+    forEachSetting(spec, "simpoint", [&](const string &key, const string &value)
+                   {
+                       if (key == "interval")
+                           config.interval = settingValue(key, value, 1, INT64_MAX);
+                       else if (key == "warmup")
+                           config.warmup = settingValue(key, value, 0, INT64_MAX);
+                       else if (key == "k")
+                           config.maxClusters = settingValue(key, value, 1);
+                       else if (key == "samples")
+                           config.samples = settingValue(key, value, 1);
+                       else if (key == "dims")
+                           config.dimensions = settingValue(key, value, 1);
+                       else if (key == "seed")
+                           config.seed = settingValue(key, value, 0, INT64_MAX);
+                       else
+                           return false;
+                       return true;
+                   });
+    return config;
+}
+
+void printCacheReport(ostream &out, const string &name, const Cache &cache, bool profile)
+{
+    if (!cache.enabled())
+        return;
+
+    const CacheCounters &c = cache.counters();
+    out << name << ": ";
+    printCacheCounters(out, c);
+    out << endl;
+
+    // accuracy: prefetches that were used; coverage: misses they removed;
+    // timeliness: used prefetches that had arrived in time
+    if (cache.settings().prefetcher != PrefetcherKind::None)
+        out << name << " prefetch: " << c.prefetches << " issued, " << c.usefulPrefetches << " useful, "
+            << c.latePrefetches << " late, " << c.uselessPrefetches << " useless, accuracy "
+            << (c.prefetches ? 100.0 * c.usefulPrefetches / c.prefetches : 0.0) << "%, coverage "
+            << (c.usefulPrefetches + c.misses ? 100.0 * c.usefulPrefetches / (c.usefulPrefetches + c.misses) : 0.0)
+            << "%, timeliness "
+            << (c.usefulPrefetches ? 100.0 * (c.usefulPrefetches - c.latePrefetches) / c.usefulPrefetches : 0.0)
+            << "%" << endl;
+    if (!profile)
+        return;
+
+    for (auto &entry : cache.byPc())
+    {
+        if (entry.first < 0)
+            continue; // misses and writebacks from the level above
+        out << name << " PC " << entry.first << ": ";
+        printCacheCounters(out, entry.second);
+        out << endl;
+    }
+    for (auto &entry : cache.byRegion())
+    {
+        out << name << " region " << entry.first << "-" << entry.first + cache.settings().regionBytes - 1 << ": ";
+        printCacheCounters(out, entry.second);
+        out << endl;
+    }
+}
+
+// Writes the counters accumulated since 'last' as one line and flushes it,
+// so long runs can be followed while they execute
+void printInterval(ostream &out, const PipelineStats &now, const PipelineStats &last)
+{
+    uint64_t cycles = now.cycles - last.cycles;
+    uint64_t instructions = now.instructions - last.instructions;
+    out << "interval end=" << now.cycles << " cycles=" << cycles << " instructions=" << instructions
+        << " ipc=" << (cycles ? (double)instructions / cycles : 0.0)
+        << " stalls=" << now.stallCycles - last.stallCycles
+        << " memory_stalls=" << now.memoryStallCycles - last.memoryStallCycles
+        << " fetch_stalls=" << now.fetchStallCycles - last.fetchStallCycles
+        << " unit_stalls=" << now.unitStallCycles - last.unitStallCycles
+        << " branches=" << now.branches - last.branches
+        << " flushes=" << now.flushes - last.flushes << endl;
+}
+
+// Quoted JSON string
+string jsonString(const string &text)
+{
+    string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+            quoted += '\\';
+        if ((unsigned char)c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else
+            quoted += c;
+    }
+    return quoted + "\"";
+}
+
+void writeJsonCache(ostream &out, const char *name, const Cache &cache)
+{
+    if (!cache.enabled())
+        return;
+    const CacheCounters &c = cache.counters();
+    out << ",\"" << name << "\":{\"accesses\":" << c.accesses << ",\"hits\":" << c.hits
+        << ",\"misses\":" << c.misses << ",\"writebacks\":" << c.writebacks
+        << ",\"write_throughs\":" << c.writeThroughs << "}";
+}
+
+// Writes the counters of a run as one JSON object
+void writeStatsJson(ostream &out, const Core &core)
+{
+    const PipelineStats &s = core.stats;
+    out << "{\"cycles\":" << s.cycles << ",\"instructions\":" << s.instructions
+        << ",\"cpi\":" << (s.instructions ? (double)s.cycles / s.instructions : 0.0)
+        << ",\"functional_instructions\":" << core.functionalInstructions()
+        << ",\"resident_pages\":" << core.DM.residentPages();
+    if (core.exited())
+        out << ",\"exit_code\":" << core.exitCode();
+
+    out << ",\"stalls\":{\"decode\":" << s.stallCycles << ",\"raw_rs1\":" << s.rs1StallCycles
+        << ",\"raw_rs2\":" << s.rs2StallCycles << ",\"waw\":" << s.wawStallCycles
+        << ",\"serialize\":" << s.serializeStallCycles << ",\"structural\":" << s.unitStallCycles
+        << ",\"memory\":" << s.memoryStallCycles << ",\"fetch\":" << s.fetchStallCycles << "}";
+    out << ",\"control\":{\"branches\":" << s.branches - s.jumps << ",\"jumps\":" << s.jumps
+        << ",\"branch_flushes\":" << s.flushes - s.jumpFlushes << ",\"jump_flushes\":" << s.jumpFlushes << "}";
+
+    out << ",\"opcodes\":{";
+    bool first = true;
+    for (auto &entry : core.opcodeCounts())
+    {
+        out << (first ? "" : ",") << "\"" << entry.first << "\":" << entry.second;
+        first = false;
+    }
+    out << "}";
+
+    writeJsonCache(out, "icache", core.instructionCache());
+    writeJsonCache(out, "dcache", core.dataCache());
+    if (core.memorySystem().secondLevel().enabled())
+        writeJsonCache(out, "l2", core.memorySystem().secondLevel());
+    out << "}";
+}
+
+// Prints the cycles charged to each static basic block, most first, then to
+// each PC that was charged any. A block starts at the entry, at a branch or
+// jump target, and after a branch or jump.
+void printCycleProfile(ostream &out, const Core &core)
+{
+    const Program &program = core.currentProgram();
+    const vector<uint64_t> &cycles = core.cyclesByPc();
+    const vector<uint64_t> &retired = core.retiredByPc();
+    int size = (int)cycles.size();
+
+    vector<bool> leader(size + 1, false);
+    if (program.Entry >= 0 && program.Entry < size)
+        leader[program.Entry] = true;
+    for (int pc = 0; pc < size; pc++)
+    {
+        const DecodedInst &inst = program.DecodedMemory[pc];
+        if (!inst.CW.Branch && !inst.CW.Jump)
+            continue;
+        leader[pc + 1] = true;
+        int target = branchTarget(pc, inst.imm);
+        if (!inst.CW.Indirect && target >= 0 && target < size)
+            leader[target] = true;
+    }
+
+    struct Block
+    {
+        int start, end;
+        uint64_t cycles;
+    };
+    vector<Block> blocks;
+    for (int pc = 0; pc < size; pc++)
+    {
+        if (leader[pc] || blocks.empty())
+            blocks.push_back(Block{pc, pc, 0});
+        blocks.back().end = pc;
+        blocks.back().cycles += cycles[pc];
+    }
+    stable_sort(blocks.begin(), blocks.end(), [](const Block &a, const Block &b)
+                { return a.cycles > b.cycles; });
+
+    double total = max<uint64_t>(core.stats.cycles, 1);
+    for (const Block &block : blocks)
+    {
+        if (!block.cycles)
+            break;
+        out << "Profile block " << block.start << "-" << block.end << ": " << block.cycles << " cycles ("
+            << 100.0 * block.cycles / total << "%), " << retired[block.start] << " executions" << endl;
+    }
+    for (int pc = 0; pc < size; pc++)
+        if (cycles[pc])
+            out << "Profile PC " << pc << " " << mnemonic(program.DecodedMemory[pc]) << ": " << cycles[pc]
+                << " cycles, " << retired[pc] << " retired" << endl;
+}
+
+// Writes the cycles of each call stack in the folded format read by flame
+// graph tools: the frames outermost first, separated by ';', then the count
+void writeFoldedStacks(ostream &out, const Core &core)
+{
+    const Program &program = core.currentProgram();
+    const vector<CallProfile::Context> &nodes = core.callProfile().nodes();
+    vector<string> stacks(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) // a parent always precedes its children
     {
-        exmo.Valid = false;
+        const CallProfile::Context &node = nodes[i];
+        string frame = program.functionName(node.function);
+        stacks[i] = node.parent < 0 ? frame : stacks[node.parent] + ";" + frame;
+        if (node.cycles)
+            out << stacks[i] << " " << node.cycles << "\n";
+    }
+}
+
+void printMemoryReport(ostream &out, const MemoryBackend &memory, bool profile)
+{
+    if (!memory.active())
         return;
+
+    const MshrCounters &m = memory.counters();
+    out << "MSHR: " << m.misses << " misses, " << m.merged << " merged, " << m.peak << " peak in flight, "
+        << m.fullCycles << " cycles waiting for a free entry" << endl;
+    printCacheReport(out, "L2", memory.secondLevel(), profile);
+    if (const Dram *dram = memory.memory())
+    {
+        const DramCounters &d = dram->counters();
+        out << "DRAM: " << d.reads << " reads, " << d.writes << " writes, " << d.rowHits << " row hits, "
+            << d.rowEmpty << " row empty, " << d.rowConflicts << " row conflicts, average read latency "
+            << (d.reads ? (double)d.readCycles / d.reads : 0.0) << endl;
+    }
+}
+
+// Prints a binary trace written by TraceWriter as one line per record
+void decodeTrace(const string &path, ostream &out)
+{
+    static const char *const stageNames[5] = {"IF", "ID", "EX", "MEM", "WB"};
+    static const char *const causes[8] = {"", "rs1", "rs2", "waw", "serialize", "?", "?", "?"};
+
+    MappedFile file(path);
+    const uint8_t *p = file.data(), *end = p + file.size();
+    if (file.size() < sizeof(TraceWriter::Magic) || memcmp(p, TraceWriter::Magic, sizeof(TraceWriter::Magic)) != 0)
+        throw runtime_error(path + ": not a pipeline trace");
+    p += sizeof(TraceWriter::Magic);
+
+    int64_t lastPc[5] = {};
+    uint32_t lastAddress = 0;
+    uint64_t cycle = 0;
+    while (p < end)
+    {
+        if (end - p < 2)
+            throw runtime_error("truncated trace record");
+        uint8_t stages = *p++, events = *p++;
+        if (stages & 0x80)
+            cycle += getVarint(p, end);
+        uint64_t span = stages & 0x40 ? getVarint(p, end) + 1 : 1;
+
+        out << "cycle " << cycle;
+        if (span > 1)
+            out << "-" << cycle + span - 1;
+        out << ":";
+        for (int s = 0; s < 5; s++)
+        {
+            out << " " << stageNames[s] << "=";
+            if (stages >> s & 1)
+                out << (lastPc[s] += unzigzag(getVarint(p, end)));
+            else
+                out << "-";
+        }
+        if (events & 7)
+            out << " stall=" << causes[events & 7];
+        if (events & 0x08)
+            out << " mem-wait";
+        if (events & 0x10)
+            out << " redirect";
+        if (events & 0x20)
+            out << " unit-busy";
+        if (events & 0x40)
+            out << " fetch-wait";
+
+        for (uint64_t n = stages & 0x20 ? getVarint(p, end) : 0; n > 0; n--)
+        {
+            if (p == end)
+                throw runtime_error("truncated trace record");
+            uint8_t kind = *p++;
+            if (kind == 0)
+            {
+                if (p == end)
+                    throw runtime_error("truncated trace record");
+                int rd = *p++;
+                out << " GPR[" << rd << "]=" << (int32_t)getVarint(p, end);
+            }
+            else
+            {
+                lastAddress += (uint32_t)unzigzag(getVarint(p, end));
+                out << " DM" << (8 << (kind - 1)) << "[" << lastAddress << "]=" << (int32_t)getVarint(p, end);
+            }
+        }
+        out << '\n';
+        cycle += span;
+    }
+}
+
+// Fast-forwards functionally if asked to, then runs the detailed pipeline
+// until the last instruction has left WB or a budget is used up. Returns the
+// instructions executed functionally.
+uint64_t simulate(Core &core, const SimOptions &options)
+{
+    uint64_t budget = options.functional ? options.maxInstructions : options.fastForward;
+    uint64_t skipped = 0;
+    if (budget > 0) // a restored core may be mid-flight, which the functional simulator refuses
+        skipped = options.translate ? core.runTranslated(budget) : core.runFunctional(budget);
+    if (options.functional)
+        return skipped;
+
+    if (options.interval == 0)
+    {
+        core.run(options.maxCycles, options.maxInstructions);
+        return skipped;
+    }
+
+    PipelineStats last = core.stats;
+    while (core.busy() && core.stats.cycles < options.maxCycles && core.stats.instructions < options.maxInstructions)
+    {
+        uint64_t boundary = last.cycles + options.interval;
+        core.run(min(boundary, options.maxCycles), options.maxInstructions);
+        printInterval(*options.intervalOut, core.stats, last);
+        last = core.stats;
     }
+    return skipped;
+}
+
+void CPUPipelineProcessing(shared_ptr<const Program> program, const SimOptions &options = SimOptions(), bool quiet = false)
+{
+    Core core(move(program), options.config);
+    if (quiet)
+        core.log = nullptr;
+    core.trace = options.trace;
+    if (!options.restorePath.empty())
+        core.restore(options.restorePath);
+
+    uint64_t skipped = simulate(core, options);
+    if (skipped)
+        cout << "Functional: " << skipped << " instructions" << endl;
+    if (!options.checkpointPath.empty())
+        core.checkpoint(options.checkpointPath);
 
-    string AluSelect = ALUControl(idex.imm2, idex.FUNC, idex.CW.ALUOP);
-    exmo.ALUOUT = ALU(AluSelect, idex.RS1, idex.RS2);
+    cout << "Clock: " << core.cycleCount() << endl;
+    cout << "Instructions: " << core.stats.instructions << endl;
+    if (core.exited())
+        cout << "Exit code: " << core.exitCode() << endl;
 
-    int AluZeroFlag = ALUFLAG(idex.RS1, idex.RS2, idex.FUNC);
+    if (options.blockProfile)
+        for (const TranslatedBlock *block : core.blockProfile())
+            cout << "Block " << block->startPc << "-" << block->startPc + block->length - 1
+                 << ": " << block->executions << " executions" << endl;
 
-    exmo.CW = idex.CW;
-    exmo.RDL = idex.RDL;
-    exmo.RS2 = idex.RS22;
+    printCacheReport(cout, "I-cache", core.instructionCache(), options.cacheProfile);
+    printCacheReport(cout, "D-cache", core.dataCache(), options.cacheProfile);
+    printMemoryReport(cout, core.memorySystem(), options.cacheProfile);
 
-    if (idex.CW.Branch && AluZeroFlag)
+    if (options.branchProfile)
     {
-        pc.Value = ((idex.imm1 << 1)) / 4 + idex.pc2.Dpc;
-        ifid.Valid = false;
-        idex.Valid = false;
-        pc.Valid = true;        
+        cout << "Branches: " << core.stats.branches << " mispredicted: " << core.stats.flushes << endl;
+        for (auto &entry : core.branchProfile())
+        {
+            const BranchPredictor::Accuracy &acc = entry.second;
+            cout << "Branch " << entry.first << ": " << acc.executions << " executions, " << acc.taken
+                 << " taken, " << acc.mispredictions << " mispredicted, accuracy "
+                 << 100.0 * (acc.executions - acc.mispredictions) / acc.executions << "%" << endl;
+        }
     }
 
-    if (idex.CW.Jump)
+    if (options.cycleProfile)
+        printCycleProfile(cout, core);
+    if (options.foldedOut)
+        writeFoldedStacks(*options.foldedOut, core);
+
+    cout << "Final GPR State: ";
+    for (int i = 0; i < 32; i++)
+        cout << core.GPR[i].value << " ";
+
+    if (options.statsOut)
     {
-        pc.Value = idex.pc2.Jpc;
-        ifid.Valid = false;
-        idex.Valid = false;
-        pc.Valid = true;
+        if (options.statsOut == &cout)
+            cout << '\n'; // the GPR line is left open
+        writeStatsJson(*options.statsOut, core);
+        *options.statsOut << endl;
     }
+}
+
+// Basic-block vectors of a run cut into fixed instruction intervals. Each
+// vector holds the share of the interval's instructions executed in every
+// block, reduced by a random projection to a few dimensions.
+struct IntervalProfile
+{
+    vector<vector<double>> points;
+    vector<uint64_t> lengths; // instructions in each interval; only the last is short
+    uint64_t instructions = 0;
+    bool exited = false;
+    int exitCode = 0;
+};
 
-    idex.Stall = false;
-    exmo.Valid = true;
+// Coordinate of a block along one projected dimension, uniform in [-1, 1).
+// It depends only on the block's start PC, not on when it was discovered.
+double projectionWeight(uint64_t seed, int pc, int dimension)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ull * ((uint64_t)(uint32_t)pc << 8 | (uint32_t)dimension);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (double)(z >> 11) * 0x1.0p-52 - 1.0;
 }
 
-void memoryOperation()
+// Runs the program from the translation cache for at most maxInstructions
+// and records the basic-block vector of every interval, taking the blocks
+// from the translated blocks' execution counts
+IntervalProfile profileIntervals(shared_ptr<const Program> program, const SimPointConfig &sp, uint64_t maxInstructions)
 {
-    if (mowb.Stall || !exmo.Valid)
+    Core core(move(program));
+    core.log = nullptr;
+    core.console = nullptr;
+
+    IntervalProfile profile;
+    unordered_map<int, uint64_t> counted; // executions of each block at the last boundary
+    while (core.busy() && profile.instructions < maxInstructions)
     {
-        mowb.Valid = false;
-        return;
+        uint64_t n = core.runTranslated(min(sp.interval, maxInstructions - profile.instructions));
+        if (n == 0)
+            break;
+        vector<double> point(sp.dimensions, 0.0);
+        for (const TranslatedBlock *block : core.blockProfile())
+        {
+            uint64_t &last = counted[block->startPc];
+            if (block->executions == last)
+                continue;
+            double share = (double)(block->executions - last) * block->length / n;
+            last = block->executions;
+            for (int d = 0; d < sp.dimensions; d++)
+                point[d] += share * projectionWeight(sp.seed, block->startPc, d);
+        }
+        profile.points.push_back(move(point));
+        profile.lengths.push_back(n);
+        profile.instructions += n;
     }
+    profile.exited = core.exited();
+    profile.exitCode = core.exitCode();
+    return profile;
+}
+
+double squaredDistance(const vector<double> &a, const vector<double> &b)
+{
+    double sum = 0;
+    for (size_t d = 0; d < a.size(); d++)
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    return sum;
+}
 
-    if (exmo.CW.MemWrite)
+struct Clustering
+{
+    vector<int> cluster; // of each point
+    vector<vector<double>> centroids;
+    double distortion = 0; // sum of squared distances to the centroids
+};
+
+// Lloyd's k-means from k-means++ seeds. Stops seeding early, and so returns
+// fewer clusters, when every point already coincides with a seed.
+Clustering kMeans(const vector<vector<double>> &points, int k, mt19937_64 &rng)
+{
+    Clustering result;
+    vector<double> nearest(points.size(), numeric_limits<double>::infinity());
+    result.centroids.push_back(points[uniform_int_distribution<size_t>(0, points.size() - 1)(rng)]);
+    while ((int)result.centroids.size() < k)
     {
-        DM[exmo.ALUOUT] = exmo.RS2;
-        cout << " DM[" << exmo.ALUOUT << "] =  " << DM[exmo.ALUOUT] << endl;
+        double total = 0;
+        for (size_t i = 0; i < points.size(); i++)
+            total += nearest[i] = min(nearest[i], squaredDistance(points[i], result.centroids.back()));
+        if (total <= 0)
+            break;
+        double pick = uniform_real_distribution<double>(0, total)(rng);
+        size_t i = 0;
+        while (i + 1 < points.size() && (pick -= nearest[i]) > 0)
+            i++;
+        result.centroids.push_back(points[i]);
     }
-    if (exmo.CW.MemRead)
-        mowb.LDOUT = DM[exmo.ALUOUT];
 
-    mowb.ALUOUT = exmo.ALUOUT;
+    result.cluster.assign(points.size(), -1);
+    for (int iteration = 0; iteration < 100; iteration++)
+    {
+        bool moved = false;
+        result.distortion = 0;
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            int best = 0;
+            double bestDistance = numeric_limits<double>::infinity();
+            for (size_t c = 0; c < result.centroids.size(); c++)
+            {
+                double distance = squaredDistance(points[i], result.centroids[c]);
+                if (distance < bestDistance)
+                {
+                    best = (int)c;
+                    bestDistance = distance;
+                }
+            }
+            moved |= result.cluster[i] != best;
+            result.cluster[i] = best;
+            result.distortion += bestDistance;
+        }
+        if (!moved)
+            break;
 
-    mowb.CW = exmo.CW;
-    mowb.RDL = exmo.RDL;
+        vector<vector<double>> sums(result.centroids.size(), vector<double>(points[0].size(), 0.0));
+        vector<size_t> sizes(result.centroids.size(), 0);
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            sizes[result.cluster[i]]++;
+            for (size_t d = 0; d < points[i].size(); d++)
+                sums[result.cluster[i]][d] += points[i][d];
+        }
+        for (size_t c = 0; c < sums.size(); c++)
+            if (sizes[c]) // an emptied cluster keeps its centroid
+            {
+                for (double &x : sums[c])
+                    x /= sizes[c];
+                result.centroids[c] = move(sums[c]);
+            }
+    }
+    return result;
+}
 
-    exmo.Stall = false;
-    mowb.Valid = true;
+// Clusters the intervals with the smallest k, up to maxClusters, whose
+// distortion is within 10% of that of a single cluster or negligible in
+// itself; each k keeps the best of a few k-means restarts
+Clustering clusterIntervals(const vector<vector<double>> &points, const SimPointConfig &sp)
+{
+    mt19937_64 rng(sp.seed);
+    Clustering chosen;
+    double single = 0, negligible = 1e-6 * points.size();
+    for (int k = 1; k <= min<int>(sp.maxClusters, points.size()); k++)
+    {
+        Clustering best;
+        for (int restart = 0; restart < 5; restart++)
+        {
+            Clustering attempt = kMeans(points, k, rng);
+            if (restart == 0 || attempt.distortion < best.distortion)
+                best = move(attempt);
+        }
+        if (k == 1)
+            single = best.distortion;
+        chosen = move(best);
+        if (chosen.distortion <= max(0.1 * single, negligible) || (int)chosen.centroids.size() < k)
+            break;
+    }
+    return chosen;
 }
 
-void writeBack()
+// CPI of one interval simulated in detail
+struct IntervalSample
 {
-    if (!mowb.Valid)
-        return;
-    if (!mowb.CW.RegWrite)
+    int interval;
+    int cluster;
+    bool representative; // the interval closest to its cluster's centroid
+    uint64_t instructions;
+    uint64_t cycles;
+};
+
+// Sampled simulation: profiles basic-block vectors per interval, clusters
+// them, and runs only a few intervals of each cluster on the detailed
+// pipeline, each after a detailed warm-up. The run jumps between them with
+// the translation cache. Total CPI is the instruction-weighted mean of the
+// clusters' CPIs; its error bound is the 95% interval of that stratified
+// estimate, from the spread of CPI within the clusters.
+void SimPointProcessing(shared_ptr<const Program> program, const SimOptions &options, const SimPointConfig &sp)
+{
+    IntervalProfile profile = profileIntervals(program, sp, options.maxInstructions);
+    if (profile.points.empty())
+    {
+        cout << "SimPoint: the program runs no instructions" << endl;
         return;
+    }
+    Clustering clustering = clusterIntervals(profile.points, sp);
+    int clusters = (int)clustering.centroids.size();
 
-    if (mowb.CW.Mem2Reg && GPR[mowb.RDL].valid > 0)
+    // Per cluster: its intervals, the one nearest the centroid first, then
+    // the rest in random order to draw further samples from
+    vector<vector<int>> members(clusters);
+    for (size_t i = 0; i < profile.points.size(); i++)
+        members[clustering.cluster[i]].push_back((int)i);
+    mt19937_64 rng(sp.seed);
+    vector<IntervalSample> samples;
+    for (int c = 0; c < clusters; c++)
     {
-        GPR[mowb.RDL].value = mowb.LDOUT;
-        GPR[mowb.RDL].valid -= 1;
-        ifid.Stall = false;
-        ifid.Valid = true;
+        vector<int> &m = members[c];
+        if (m.empty())
+            continue;
+        auto nearest = min_element(m.begin(), m.end(), [&](int a, int b)
+                                   { return squaredDistance(profile.points[a], clustering.centroids[c]) <
+                                            squaredDistance(profile.points[b], clustering.centroids[c]); });
+        iter_swap(m.begin(), nearest);
+        shuffle(m.begin() + 1, m.end(), rng);
+        for (int s = 0; s < min<int>(sp.samples, m.size()); s++)
+            samples.push_back(IntervalSample{m[s], c, s == 0, 0, 0});
     }
-    else
+    sort(samples.begin(), samples.end(), [](const IntervalSample &a, const IntervalSample &b)
+         { return a.interval < b.interval; });
+
+    // Detailed pass, in program order
+    Core core(program, options.config);
+    core.log = nullptr;
+    core.console = nullptr;
+    auto retired = [&]()
+    { return core.functionalInstructions() + core.stats.instructions; };
+    auto runTo = [&](uint64_t target)
     {
-        GPR[mowb.RDL].value = mowb.ALUOUT;
-        GPR[mowb.RDL].valid -= 1;
-        ifid.Stall = false;
-        ifid.Valid = true;
+        if (target > retired())
+            core.run(UINT64_MAX, target - core.functionalInstructions());
+    };
+    for (IntervalSample &sample : samples)
+    {
+        uint64_t start = sample.interval * sp.interval;
+        uint64_t warmStart = start > sp.warmup ? start - sp.warmup : 0;
+        if (warmStart > retired())
+        {
+            core.drain();
+            if (warmStart > retired())
+                core.runTranslated(warmStart - retired());
+        }
+        runTo(start);
+        uint64_t cycles = core.stats.cycles, before = retired();
+        runTo(start + profile.lengths[sample.interval]);
+        sample.cycles = core.stats.cycles - cycles;
+        sample.instructions = retired() - before;
+    }
+
+    // Stratified estimate over the clusters
+    double cpi = 0, variance = 0, pooled = 0;
+    int pooledClusters = 0;
+    bool bounded = true;
+    uint64_t detailed = 0;
+    vector<double> weight(clusters, 0.0), mean(clusters, 0.0), spread(clusters, -1.0);
+    vector<int> sampled(clusters, 0);
+    for (int c = 0; c < clusters; c++)
+        for (int i : members[c])
+            weight[c] += (double)profile.lengths[i] / profile.instructions;
+    for (int c = 0; c < clusters; c++)
+    {
+        vector<double> cpis;
+        for (const IntervalSample &sample : samples)
+            if (sample.cluster == c && sample.instructions > 0)
+                cpis.push_back((double)sample.cycles / sample.instructions);
+        sampled[c] = cpis.size();
+        if (cpis.empty())
+            continue;
+        for (double x : cpis)
+            mean[c] += x / cpis.size();
+        if (cpis.size() > 1)
+        {
+            spread[c] = 0;
+            for (double x : cpis)
+                spread[c] += (x - mean[c]) * (x - mean[c]) / (cpis.size() - 1);
+            pooled += spread[c];
+            pooledClusters++;
+        }
+    }
+    double covered = 0;
+    for (int c = 0; c < clusters; c++)
+        if (sampled[c])
+            covered += weight[c];
+    for (int c = 0; c < clusters; c++)
+    {
+        if (!sampled[c])
+            continue;
+        double w = weight[c] / covered;
+        cpi += w * mean[c];
+        if (sampled[c] == (int)members[c].size())
+            continue; // every interval of the cluster was simulated
+        // a single sample says nothing about its cluster's spread; assume
+        // the average spread of the others
+        double s2 = spread[c] >= 0 ? spread[c] : pooledClusters ? pooled / pooledClusters : -1;
+        if (s2 < 0)
+            bounded = false;
+        else
+            variance += w * w * s2 / sampled[c] * (1.0 - (double)sampled[c] / members[c].size());
+    }
+    for (const IntervalSample &sample : samples)
+        detailed += sample.instructions;
+
+    cout << "SimPoint: " << profile.points.size() << " intervals of " << sp.interval << " instructions, " << clusters
+         << " clusters, " << samples.size() << " simulated in detail (" << 100.0 * detailed / profile.instructions
+         << "% of instructions)" << endl;
+    for (int c = 0; c < clusters; c++)
+    {
+        cout << "SimPoint cluster " << c << ": " << members[c].size() << " intervals, weight " << weight[c] << ", CPI " << mean[c]
+             << ", samples";
+        for (const IntervalSample &sample : samples)
+            if (sample.cluster == c)
+                cout << " " << sample.interval << (sample.representative ? "*" : "");
+        cout << endl;
     }
-    mowb.Stall = false;
-    cout << " GPR[" << mowb.RDL << "] = " << GPR[mowb.RDL].value << endl;
+    double half = 1.96 * sqrt(variance);
+    cout << "Instructions: " << profile.instructions << endl;
+    cout << "Estimated CPI: " << cpi;
+    if (bounded)
+        cout << " +- " << half << " (95%)";
+    cout << endl;
+    cout << "Estimated clock: " << (uint64_t)llround(cpi * profile.instructions);
+    if (bounded)
+        cout << " +- " << (uint64_t)llround(half * profile.instructions) << " (95%)";
+    cout << endl;
+    if (profile.exited)
+        cout << "Exit code: " << profile.exitCode << endl;
 }
 
-void CPUPipelineProcessing(const vector<string> &binaryInst)
+// Batch mode
+
+// Runs a fixed set of jobs on worker threads. Each worker owns a deque seeded
+// round-robin; it pops from the back of its own deque and, once that is empty,
+// steals from the front of the others.
+class WorkStealingPool
 {
-    InstructionMemory.clear();
+public:
+    explicit WorkStealingPool(unsigned threads) : workers(max(1u, threads)) {}
 
-    for (const string &inp : binaryInst)
+    unsigned size() const { return workers; }
+
+    void run(size_t jobs, const function<void(unsigned, size_t)> &work)
     {
-        InstructionMemory.push_back(inp);
+        vector<Queue> queues(workers);
+        for (size_t j = 0; j < jobs; j++)
+            queues[j % workers].jobs.push_back(j);
 
-        // if (inp.substr(25, 7) == "1100011")
-        // {
-        //     InstructionMemory.push_back("00000000000000000000000000010011");
-        //     InstructionMemory.push_back("00000000000000000000000000010011");
-        // }
+        vector<thread> threads;
+        for (unsigned w = 0; w < workers; w++)
+            threads.emplace_back([&, w]()
+                                 {
+                                     size_t job;
+                                     while (take(queues, w, job))
+                                         work(w, job);
+                                 });
+        for (auto &t : threads)
+            t.join();
     }
 
-    pc = PC(0, true);
+private:
+    struct Queue
+    {
+        mutex lock;
+        deque<size_t> jobs;
+    };
+
+    unsigned workers;
 
-    int count = 0;
-    while (count < 1000)
+    bool take(vector<Queue> &queues, unsigned self, size_t &job)
     {
-        writeBack();
-        memoryOperation();
-        execute();
-        decode();
-        fetch();
-        count++;
+        {
+            lock_guard<mutex> guard(queues[self].lock);
+            if (!queues[self].jobs.empty())
+            {
+                job = queues[self].jobs.back();
+                queues[self].jobs.pop_back();
+                return true;
+            }
+        }
 
-        if (running == 0)
-            break;
+        // Jobs are never added once the pool runs, so a full sweep over
+        // empty queues means there is nothing left to do
+        for (unsigned i = 1; i < workers; i++)
+        {
+            Queue &victim = queues[(self + i) % workers];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.jobs.empty())
+            {
+                job = victim.jobs.front();
+                victim.jobs.pop_front();
+                return true;
+            }
+        }
+        return false;
     }
+};
+
+struct BatchJob
+{
+    string programPath;
+    string memoryPath;
+    shared_ptr<const Program> program;
+    vector<pair<uint32_t, int>> memoryInit;
+};
+
+struct BatchResult
+{
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t functional = 0;
+    size_t pages = 0; // resident data memory pages
+    vector<int> gpr;
+    vector<pair<uint32_t, int>> dm; // non-zero data memory words after the run
+    bool exited = false;
+    int exitCode = 0;
+    string stats; // JSON counters, if asked for
+    string error;
+};
+
+// Manifest lines are "<program> [<memory-init>]", with paths relative to the
+// manifest; programs are anything loadProgram() accepts. A memory-init file
+// holds "<byte address> <word>" pairs. Jobs that name the same program share
+// one loaded image.
+vector<BatchJob> readManifest(const string &manifestPath, uint32_t loadAddress)
+{
+    string dir;
+    size_t slash = manifestPath.find_last_of('/');
+    if (slash != string::npos)
+        dir = manifestPath.substr(0, slash + 1);
+    auto resolve = [&](const string &p)
+    { return p.empty() || p[0] == '/' ? p : dir + p; };
 
-    cout << "Clock: " << count << endl;
+    map<string, shared_ptr<const Program>> programs;
+    map<string, vector<pair<uint32_t, int>>> memories;
+    vector<BatchJob> jobs;
 
-    for (int i = 0; i < 4 && running == 0; i++)
+    for (const string &line : readSourceLines(manifestPath))
     {
-        if (i < 4)
-            writeBack();
+        BatchJob job;
+        istringstream fields(line);
+        fields >> job.programPath >> job.memoryPath;
+        job.programPath = resolve(job.programPath);
+        job.memoryPath = resolve(job.memoryPath);
 
-        if (i < 3)
-            memoryOperation();
+        auto &program = programs[job.programPath];
+        if (!program)
+            program = loadProgram(job.programPath, loadAddress);
+        job.program = program;
 
-        if (i < 2)
-            execute();
+        if (!job.memoryPath.empty())
+        {
+            auto found = memories.find(job.memoryPath);
+            if (found == memories.end())
+            {
+                vector<pair<uint32_t, int>> init;
+                for (const string &entry : readSourceLines(job.memoryPath))
+                {
+                    istringstream words(entry);
+                    string address;
+                    int value;
+                    size_t used = 0;
+                    unsigned long parsed = 0;
+                    if (words >> address >> value)
+                    {
+                        try
+                        {
+                            parsed = stoul(address, &used, 0);
+                        }
+                        catch (const exception &)
+                        {
+                            used = 0;
+                        }
+                    }
+                    if (used == 0 || used != address.size() || parsed > UINT32_MAX)
+                        throw runtime_error("bad memory-init line in " + job.memoryPath + ": " + entry);
+                    init.push_back({(uint32_t)parsed, value});
+                }
+                found = memories.emplace(job.memoryPath, move(init)).first;
+            }
+            job.memoryInit = found->second;
+        }
 
-        if (i < 1)
-            decode();
+        jobs.push_back(move(job));
     }
+    return jobs;
+}
 
-    cout << "Clocs: " << count + 4 << endl;
+int runBatch(const string &manifestPath, unsigned threads, const SimOptions &options, ostream &out)
+{
+    vector<BatchJob> jobs = readManifest(manifestPath, options.loadAddress);
+    vector<BatchResult> results(jobs.size());
 
-    cout << "Final GPR State: ";
-    for (int i = 0; i < 32; i++)
-        cout << GPR[i].value << " ";
+    WorkStealingPool pool(threads);
+    vector<unique_ptr<Core>> cores(pool.size());
+
+    auto start = chrono::steady_clock::now();
+    SimOptions jobOptions = options;
+    jobOptions.interval = 0;
+
+    pool.run(jobs.size(), [&](unsigned worker, size_t j)
+             {
+                 const BatchJob &job = jobs[j];
+                 BatchResult &result = results[j];
+
+                 try
+                 {
+                     if (!cores[worker])
+                     {
+                         cores[worker].reset(new Core(job.program, options.config));
+                         cores[worker]->log = nullptr;
+                         cores[worker]->console = nullptr;
+                     }
+                     else
+                         cores[worker]->load(job.program);
+                     Core &core = *cores[worker];
+
+                     for (auto &init : job.memoryInit)
+                         core.DM.write32(init.first, init.second);
+
+                     result.functional = simulate(core, jobOptions);
+                     result.cycles = core.cycleCount();
+                     result.instructions = core.stats.instructions;
+                     result.pages = core.DM.residentPages();
+                     result.exited = core.exited();
+                     result.exitCode = core.exitCode();
+                     if (options.statsOut)
+                     {
+                         ostringstream json;
+                         writeStatsJson(json, core);
+                         result.stats = json.str();
+                     }
+                     for (auto &reg : core.GPR)
+                         result.gpr.push_back(reg.value);
+                     core.DM.forEachPage([&](uint32_t base, const uint8_t *data)
+                                         {
+                                             for (uint32_t offset = 0; offset < PagedMemory::PageSize; offset += 4)
+                                             {
+                                                 int value = data[offset] | data[offset + 1] << 8 | data[offset + 2] << 16 | data[offset + 3] << 24;
+                                                 if (value != 0)
+                                                     result.dm.push_back({base + offset, value});
+                                             }
+                                         });
+                 }
+                 catch (const exception &ex)
+                 {
+                     result.error = ex.what();
+                 }
+             });
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t totalCycles = 0;
+    int failed = 0;
+    for (size_t j = 0; j < jobs.size(); j++)
+    {
+        const BatchResult &result = results[j];
+        out << "job " << j << " program=" << jobs[j].programPath;
+        if (!jobs[j].memoryPath.empty())
+            out << " memory=" << jobs[j].memoryPath;
+
+        if (!result.error.empty())
+        {
+            out << " error=\"" << result.error << "\"" << '\n';
+            failed++;
+            continue;
+        }
+
+        totalCycles += result.cycles;
+        if (result.functional)
+            out << " functional=" << result.functional;
+        out << " cycles=" << result.cycles << " instructions=" << result.instructions << " pages=" << result.pages;
+        if (result.exited)
+            out << " exit=" << result.exitCode;
+        out << " gpr=";
+        for (size_t i = 0; i < result.gpr.size(); i++)
+            out << (i ? "," : "") << result.gpr[i];
+        out << " dm=";
+        for (size_t i = 0; i < result.dm.size(); i++)
+            out << (i ? "," : "") << result.dm[i].first << ":" << result.dm[i].second;
+        out << '\n';
+    }
+
+    if (options.statsOut)
+    {
+        // One object per job, in manifest order; null for failed jobs
+        ostream &json = *options.statsOut;
+        json << "[";
+        for (size_t j = 0; j < jobs.size(); j++)
+            json << (j ? ",\n" : "\n") << "{\"job\":" << j << ",\"program\":" << jsonString(jobs[j].programPath)
+                 << ",\"stats\":" << (results[j].stats.empty() ? "null" : results[j].stats) << "}";
+        json << "\n]" << endl;
+    }
+
+    out << "batch jobs=" << jobs.size() << " failed=" << failed << " threads=" << pool.size()
+        << " cycles=" << totalCycles << " seconds=" << seconds
+        << " cycles_per_second=" << (seconds > 0 ? totalCycles / seconds : 0) << endl;
+    return failed ? 1 : 0;
+}
+
+// A malformed command line, reported like a usage error
+struct UsageError : invalid_argument
+{
+    using invalid_argument::invalid_argument;
+};
+
+// Value of a numeric command-line option, which must be a whole number in
+// minimum..maximum
+int64_t parseOption(const string &option, const char *text, int64_t minimum, int64_t maximum = INT64_MAX)
+{
+    int64_t value;
+    if (!parseInteger(text, value) || value < minimum || value > maximum)
+        throw UsageError("bad value '" + string(text) + "' for " + option);
+    return value;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    string manifest, output, programPath, intervalPath, statsPath, foldedPath, tracePath, decodePath, simpointSpec, icacheSpec, dcacheSpec, l2Spec, dramSpec, mulSpec, divSpec;
+    bool quiet = false;
+    unsigned threads = thread::hardware_concurrency();
+    SimOptions options;
+    unique_ptr<TraceWriter> trace; // outlives every run below
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--batch" && i + 1 < argc)
+                manifest = argv[++i];
+            else if (arg == "--threads" && i + 1 < argc)
+                threads = parseOption(arg, argv[++i], 1, UINT_MAX);
+            else if (arg == "--output" && i + 1 < argc)
+                output = argv[++i];
+            else if (arg == "--max-cycles" && i + 1 < argc)
+                options.maxCycles = parseOption(arg, argv[++i], 0);
+            else if (arg == "--max-instructions" && i + 1 < argc)
+                options.maxInstructions = parseOption(arg, argv[++i], 0);
+            else if (arg == "--interval" && i + 1 < argc)
+                options.interval = parseOption(arg, argv[++i], 0);
+            else if (arg == "--interval-file" && i + 1 < argc)
+                intervalPath = argv[++i];
+            else if (arg == "--stats-json" && i + 1 < argc)
+                statsPath = argv[++i];
+            else if (arg == "--quiet")
+                quiet = true;
+            else if (arg == "--load-address" && i + 1 < argc)
+                options.loadAddress = parseOption(arg, argv[++i], 0, UINT32_MAX);
+            else if (arg == "--fast-forward" && i + 1 < argc)
+                options.fastForward = parseOption(arg, argv[++i], 0);
+            else if (arg == "--functional")
+                options.functional = true;
+            else if (arg == "--memory-latency" && i + 1 < argc)
+                options.config.memoryLatency = parseOption(arg, argv[++i], 0, INT_MAX);
+            else if (arg == "--forwarding" && i + 1 < argc)
+            {
+                // comma-separated subset of ex-ex, mem-ex, wb-id; or all / none
+                string paths = string(",") + argv[++i] + ",";
+                bool all = paths == ",all,";
+                options.config.forwardEXtoEX = all || paths.find(",ex-ex,") != string::npos;
+                options.config.forwardMEMtoEX = all || paths.find(",mem-ex,") != string::npos;
+                options.config.forwardWBtoID = all || paths.find(",wb-id,") != string::npos;
+            }
+            else if (arg == "--predictor" && i + 1 < argc)
+            {
+                static const map<string, PredictorKind> kinds = {
+                    {"none", PredictorKind::None}, {"static", PredictorKind::Static}, {"bimodal", PredictorKind::Bimodal}, {"gshare", PredictorKind::Gshare}, {"tournament", PredictorKind::Tournament}};
+                auto kind = kinds.find(argv[++i]);
+                if (kind == kinds.end())
+                {
+                    cerr << "unknown predictor " << argv[i] << endl;
+                    return 2;
+                }
+                options.config.predictor = kind->second;
+            }
+            else if (arg == "--btb-entries" && i + 1 < argc)
+                options.config.btbEntries = parseOption(arg, argv[++i], 1, INT_MAX);
+            else if (arg == "--ras-depth" && i + 1 < argc)
+                options.config.rasDepth = parseOption(arg, argv[++i], 1, INT_MAX);
+            else if (arg == "--multiplier" && i + 1 < argc)
+                mulSpec = argv[++i];
+            else if (arg == "--divider" && i + 1 < argc)
+                divSpec = argv[++i];
+            else if (arg == "--icache" && i + 1 < argc)
+                icacheSpec = argv[++i];
+            else if (arg == "--dcache" && i + 1 < argc)
+                dcacheSpec = argv[++i];
+            else if (arg == "--l2" && i + 1 < argc)
+                l2Spec = argv[++i];
+            else if (arg == "--dram")
+            {
+                options.config.memory.dram = true;
+                if (i + 1 < argc && argv[i + 1][0] != '-' && string(argv[i + 1]).find('=') != string::npos)
+                    dramSpec = argv[++i];
+            }
+            else if (arg == "--mshrs" && i + 1 < argc)
+                options.config.memory.mshrs = parseOption(arg, argv[++i], 1, INT_MAX);
+            else if (arg == "--cache-profile")
+                options.cacheProfile = options.config.icache.profile = options.config.dcache.profile = options.config.memory.l2.profile = true;
+            else if (arg == "--branch-profile")
+                options.branchProfile = true;
+            else if (arg == "--cycle-profile")
+                options.cycleProfile = options.config.profileCycles = true;
+            else if (arg == "--folded-stacks" && i + 1 < argc)
+            {
+                foldedPath = argv[++i];
+                options.config.profileCycles = true;
+            }
+            else if (arg == "--trace" && i + 1 < argc)
+                tracePath = argv[++i];
+            else if (arg == "--decode-trace" && i + 1 < argc)
+                decodePath = argv[++i];
+            else if (arg == "--simpoint" && i + 1 < argc)
+                simpointSpec = argv[++i];
+            else if (arg == "--checkpoint" && i + 1 < argc)
+                options.checkpointPath = argv[++i];
+            else if (arg == "--restore" && i + 1 < argc)
+                options.restorePath = argv[++i];
+            else if (arg == "--no-skip")
+                options.config.skipIdle = false;
+            else if (arg == "--translate")
+                options.translate = true;
+            else if (arg == "--block-profile")
+                options.blockProfile = options.translate = true;
+            else if (arg[0] != '-' && programPath.empty())
+                programPath = arg;
+            else
+            {
+                cerr << "usage: " << argv[0] << " [program.s | program.elf | program.bin [--load-address A] | --batch <manifest> [--threads N] [--output file]]"
+                     << " [--max-cycles N] [--max-instructions N] [--interval N [--interval-file file]] [--stats-json file|-] [--quiet]"
+                     << " [--trace file] [--decode-trace file]"
+                     << " [--fast-forward N | --functional] [--translate] [--block-profile] [--checkpoint file] [--restore file]"
+                     << " [--simpoint interval=N,warmup=N,k=N,samples=N,dims=N,seed=N]"
+                     << " [--memory-latency N] [--no-skip] [--forwarding ex-ex,mem-ex,wb-id|all|none]"
+                     << " [--predictor none|static|bimodal|gshare|tournament] [--btb-entries N] [--ras-depth N] [--branch-profile]"
+                     << " [--cycle-profile] [--folded-stacks file|-]"
+                     << " [--multiplier latency=N,interval=N] [--divider latency=N,interval=N]"
+                     << " [--icache size=B,ways=N,line=B,...] [--dcache size=B,ways=N,line=B,...] [--cache-profile]"
+                     << " [--l2 size=B,ways=N,line=B,...] [--dram [banks=N,row=B,page=open|closed,trcd=N,tcas=N,trp=N,burst=N]] [--mshrs N]" << endl;
+                return 2;
+            }
+        }
+
+        ofstream intervalFile;
+        if (!intervalPath.empty())
+        {
+            intervalFile.open(intervalPath);
+            if (!intervalFile)
+            {
+                cerr << "error: cannot open " << intervalPath << endl;
+                return 1;
+            }
+            options.intervalOut = &intervalFile;
+        }
+
+        ofstream statsFile;
+        if (statsPath == "-")
+            options.statsOut = &cout;
+        else if (!statsPath.empty())
+        {
+            statsFile.open(statsPath);
+            if (!statsFile)
+            {
+                cerr << "error: cannot open " << statsPath << endl;
+                return 1;
+            }
+            options.statsOut = &statsFile;
+        }
+
+        ofstream foldedFile;
+        if (foldedPath == "-")
+            options.foldedOut = &cout;
+        else if (!foldedPath.empty())
+        {
+            foldedFile.open(foldedPath);
+            if (!foldedFile)
+            {
+                cerr << "error: cannot open " << foldedPath << endl;
+                return 1;
+            }
+            options.foldedOut = &foldedFile;
+        }
+
+        if (!decodePath.empty())
+        {
+            decodeTrace(decodePath, cout);
+            return 0;
+        }
+        if (!tracePath.empty())
+        {
+            trace = make_unique<TraceWriter>(tracePath);
+            options.trace = trace.get();
+        }
+
+        if (!mulSpec.empty())
+            options.config.multiplier = parseUnitConfig(mulSpec, options.config.multiplier);
+        if (!divSpec.empty())
+            options.config.divider = parseUnitConfig(divSpec, options.config.divider);
+        if (!icacheSpec.empty())
+            options.config.icache = parseCacheConfig(icacheSpec, options.config.icache);
+        if (!dcacheSpec.empty())
+            options.config.dcache = parseCacheConfig(dcacheSpec, options.config.dcache);
+        if (!l2Spec.empty())
+            options.config.memory.l2 = parseCacheConfig(l2Spec, options.config.memory.l2);
+        if (!dramSpec.empty())
+            options.config.memory.dramTiming = parseDramConfig(dramSpec, options.config.memory.dramTiming);
+        // Cores are built on batch worker threads, so bad settings are caught here
+        Cache::check(options.config.icache);
+        Cache::check(options.config.dcache);
+        Cache::check(options.config.memory.l2);
+        BranchPredictor::check(options.config);
+
+        if (!manifest.empty())
+        {
+            if (output.empty())
+                return runBatch(manifest, threads, options, cout);
+
+            ofstream out(output);
+            if (!out)
+                throw runtime_error("cannot open " + output);
+            return runBatch(manifest, threads, options, out);
+        }
+
+        if (!programPath.empty() && !simpointSpec.empty())
+        {
+            SimPointProcessing(loadProgram(programPath, options.loadAddress), options, parseSimPointConfig(simpointSpec));
+            return 0;
+        }
+        if (!programPath.empty())
+        {
+            CPUPipelineProcessing(loadProgram(programPath, options.loadAddress), options, quiet);
+            return 0;
+        }
+    }
+    catch (const UsageError &ex)
+    {
+        cerr << "error: " << ex.what() << endl;
+        return 2;
+    }
+    catch (const exception &ex)
+    {
+        cerr << "error: " << ex.what() << endl;
+        return 1;
+    }
+
     vector<string> assemblyLang = {
         // sum of first n numbers
         // "ADDI x15 x15 10",
@@ -942,31 +5628,18 @@ int main()
         // "ADDI x30 x30 0",
 
         // factorial
-        // "ADDI x0 x0 1",
+        // "ADDI x3 x3 1",
         // "ADDI x1 x1 5",
         // "ADDI x1 x1 1",
         // "ADDI x2 x2 1",
-        // "BEQ x0 x1 16",
-        // "MUL x2 x2 x0",
-        // "ADDI x0 x0 1",
-        // "BEQ x0 x0 -12",
+        // "BEQ x3 x1 16",
+        // "MUL x2 x2 x3",
+        // "ADDI x3 x3 1",
+        // "BEQ x3 x3 -12",
         // "ADDI x30 x30 0",
     };
 
-    vector<string> binaryInst;
-    assembler assembler;
-    for (const auto &inst : assemblyLang)
-    {
-        Instruction *parse = assembler.parseInstruction(inst);
-        bitset<32> binaryInstruction;
-        parse->toBinaryArray(binaryInstruction);
-
-        string s = binaryInstruction.to_string();
-        binaryInst.push_back(s);
-        delete parse;
-    }
-
-    CPUPipelineProcessing(binaryInst);
+    CPUPipelineProcessing(assembleProgram(assemblyLang), options, quiet);
 
     return 0;
-}
\ No newline at end of file
+}
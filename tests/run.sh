@@ -0,0 +1,193 @@
+#!/bin/sh
+# Regression checks for the simulator. Builds it with the README's command
+# and runs each case against small programs; exits non-zero on a failure.
+set -u
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+g++ -o "$work/sim" "$root/cpu-pipeline-riscv.cpp" -std=c++17 -O2 -pthread || exit 1
+sim="$work/sim"
+failures=0
+
+fail()
+{
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Prints the number before the given label in the simulator's output, e.g.
+# "100 writes" from "DRAM: 1 reads, 100 writes, ..."
+count()
+{
+    grep -o "[0-9]* $1" | head -n 1 | cut -d ' ' -f 1
+}
+
+# Prints register n of the "Final GPR State" line
+reg()
+{
+    grep '^Final GPR State' | cut -d ' ' -f $(($1 + 4))
+}
+
+# Records failure $1 unless the program on stdin is rejected with an error
+# containing $2
+rejects()
+{
+    cat > "$work/bad.s"
+    "$sim" "$work/bad.s" --quiet > /dev/null 2> "$work/bad.err" && { fail "$1: accepted"; return; }
+    grep -q "$2" "$work/bad.err" || fail "$1: got '$(cat "$work/bad.err")'"
+}
+
+# A write-through D-cache sends every store hit on to DRAM and waits for it;
+# a write-back one keeps the line dirty
+cat > "$work/stores.s" <<'ASM'
+        addi t0, zero, 100
+loop:   sw   t0, zero, 64
+        addi t0, t0, -1
+        bne  t0, zero, loop
+ASM
+back=$("$sim" "$work/stores.s" --quiet --dcache size=1024,line=16,write=back --dram)
+through=$("$sim" "$work/stores.s" --quiet --dcache size=1024,line=16,write=through --dram)
+[ "$(echo "$back" | grep '^DRAM' | count writes)" = 0 ] || fail "write-back cache wrote to DRAM on store hits"
+[ "$(echo "$through" | grep '^DRAM' | count writes)" = 100 ] || fail "write-through cache did not write every store to DRAM"
+[ "$(echo "$through" | count 'writes through')" = 100 ] || fail "write-through stores were not counted"
+clockBack=$(echo "$back" | grep '^Clock' | cut -d ' ' -f 2)
+clockThrough=$(echo "$through" | grep '^Clock' | cut -d ' ' -f 2)
+[ "$clockThrough" -gt "$clockBack" ] || fail "write-through stores were not charged"
+
+# Profiling a program with no instructions charges nothing and exits cleanly
+: > "$work/empty.s"
+"$sim" "$work/empty.s" --cycle-profile > /dev/null || fail "cycle profile of an empty program"
+"$sim" "$work/empty.s" --folded-stacks - > /dev/null || fail "folded stacks of an empty program"
+
+# .word takes any 32-bit value, signed or unsigned; a malformed or wider
+# number is a bad number, not an undefined label
+cat > "$work/words.s" <<'ASM'
+.data
+x:      .word 0xdeadbeef, -2147483648, 4294967295
+.text
+        lui  a0, %hi(x)
+        addi a0, a0, %lo(x)
+        lw   a1, a0, 0
+        lw   a2, a0, 4
+        lw   a3, a0, 8
+ASM
+out=$("$sim" "$work/words.s" --quiet)
+[ "$(echo "$out" | reg 11)" = -559038737 ] || fail ".word 0xdeadbeef"
+[ "$(echo "$out" | reg 12)" = -2147483648 ] || fail ".word -2147483648"
+[ "$(echo "$out" | reg 13)" = -1 ] || fail ".word 4294967295"
+printf '.data\n.word 4294967296\n' | rejects ".word above 32 bits" "line 2: value 4294967296 does not fit in 32 bits"
+printf 'addi a0, a0, 08\n' | rejects "bad octal literal" "line 1: bad number '08'"
+
+# Code is immutable: a store over an instruction changes data memory only,
+# in the pipeline, the interpreter and the translation cache alike
+cat > "$work/selfmod.s" <<'ASM'
+        sw   zero, zero, 12
+        nop
+        nop
+        addi a0, zero, 7
+ASM
+for mode in "" --functional "--functional --translate"; do
+    [ "$("$sim" "$work/selfmod.s" --quiet $mode | reg 10)" = 7 ] || fail "store over code changed the program ($mode)"
+done
+
+# Malformed numeric options are usage errors, not crashes or wrapped values
+for option in "--threads abc" "--threads -1" "--threads 0" "--max-cycles 10x" "--load-address 0x100000000"; do
+    "$sim" "$work/empty.s" $option > /dev/null 2> "$work/option.err"
+    status=$?
+    [ "$status" = 2 ] && grep -q "bad value" "$work/option.err" || fail "$option: exit $status, '$(cat "$work/option.err")'"
+done
+
+# Settings values must be whole numbers in range
+for option in "--dcache size=1024,ways=4x" "--icache size=1024,line=abc" "--dram banks=0" "--multiplier latency=-1" \
+              "--simpoint interval=-1" "--simpoint warmup=-1" "--simpoint seed=-1" "--simpoint samples=0" "--simpoint dims=0"; do
+    "$sim" "$work/empty.s" $option > /dev/null 2> "$work/option.err" && fail "$option: accepted"
+    grep -q "bad value for" "$work/option.err" || fail "$option: got '$(cat "$work/option.err")'"
+done
+
+# Data memory holds only the pages a program writes, however far apart
+cat > "$work/pages.s" <<'ASM'
+        lui  t0, 0x7ffff
+        sw   t0, t0, 0
+        sw   t0, zero, 64
+ASM
+"$sim" "$work/pages.s" --quiet --stats-json "$work/pages.json" > /dev/null
+grep -q '"resident_pages":2' "$work/pages.json" || fail "resident pages: $(cat "$work/pages.json")"
+
+# Assembler: labels used before they are defined, .data with .byte, .align
+# and .word, %hi/%lo address pairs, calls and an exit system call
+cat > "$work/kernel.s" <<'ASM'
+.data
+        .byte 1
+        .align 2
+arr:    .word 3, 1, 4, 1, 5, 9, 2, 6
+n:      .word 8
+.text
+        lui  s0, %hi(arr)
+        addi s0, s0, %lo(arr)
+        lui  t0, %hi(n)
+        lw   s1, t0, %lo(n)
+        addi s2, zero, 5
+again:  addi a0, s0, 0
+        addi a1, s1, 0
+        jal  ra, sum            # forward reference
+        add  s3, s3, a0
+        addi s2, s2, -1
+        bne  s2, zero, again
+        mul  s4, s3, s3
+        div  s6, s3, s1
+        sw   s4, s0, 32
+        lw   s5, s0, 32
+        addi a7, zero, 93
+        addi a0, s3, 0
+        ecall
+sum:    addi t1, zero, 0
+loop:   lw   t2, a0, 0
+        add  t1, t1, t2
+        addi a0, a0, 4
+        addi a1, a1, -1
+        bne  a1, zero, loop
+        addi a0, t1, 0
+        jalr zero, ra, 0
+ASM
+out=$("$sim" "$work/kernel.s" --quiet)
+[ "$(echo "$out" | reg 8)" = 268435460 ] || fail ".align after .byte, or %hi/%lo of a label"
+[ "$(echo "$out" | reg 9)" = 8 ] || fail "load through %lo of a label"
+[ "$(echo "$out" | reg 19)" = 155 ] || fail "forward call to a label"
+[ "$(echo "$out" | reg 21)" = 24025 ] || fail "store and load back"
+echo "$out" | grep -q '^Exit code: 155$' || fail "exit system call"
+
+# Operands that do not fit their field are errors, with the line number
+printf 'nop\nbne a0, zero, nowhere\n' | rejects "undefined label" "line 2: undefined label 'nowhere'"
+printf 'x: nop\nx: nop\n' | rejects "duplicate label" "line 2: label 'x' is defined twice"
+printf 'addi a0, a0, 2048\n' | rejects "12-bit immediate" "does not fit in 12 bits"
+printf 'slli a0, a0, 32\n' | rejects "shift amount" "is not in 0..31"
+printf 'lui a0, 0x100000\n' | rejects "20-bit immediate" "does not fit in 20 bits"
+printf 'beq a0, a0, 6\n' | rejects "misaligned branch" "is not an instruction"
+printf 'beq a0, a0, 4096\n' | rejects "branch range" "is out of range"
+printf '.data\nv: .word 1\n.text\naddi a0, zero, v\n' | rejects "wide label address" "use %lo"
+printf 'foo a0\n' | rejects "unknown instruction" "line 1: unknown instruction 'foo'"
+
+# Every timing configuration, the functional modes and a run split by a
+# checkpoint reach the same architectural state
+final()
+{
+    grep -E '^(Final GPR State|Exit code)' | sed 's/ *$//'
+}
+expected=$("$sim" "$work/kernel.s" --quiet --functional | final)
+for mode in "" "--forwarding all" "--forwarding ex-ex --predictor gshare" \
+            "--predictor tournament --forwarding mem-ex --multiplier latency=4 --divider latency=20,interval=20" \
+            "--functional --translate" "--fast-forward 50" \
+            "--dcache size=256,ways=2,line=16,write=through --icache size=256,line=16,prefetch=next-line --dram"; do
+    [ "$("$sim" "$work/kernel.s" --quiet $mode | final)" = "$expected" ] || fail "state differs with '$mode'"
+done
+"$sim" "$work/kernel.s" --quiet --forwarding all --max-instructions 40 --checkpoint "$work/kernel.snap" > /dev/null
+[ "$("$sim" "$work/kernel.s" --quiet --restore "$work/kernel.snap" --predictor gshare | final)" = "$expected" ] ||
+    fail "state differs after checkpoint and restore"
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures failed"
+    exit 1
+fi
+echo "All tests passed"